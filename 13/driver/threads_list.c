@@ -36,96 +36,1623 @@
 #include <linux/kthread.h>
 #include <linux/sched.h>
 #include <linux/delay.h>
+#include <linux/percpu.h>
+#include <linux/atomic.h>
+#include <linux/completion.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/cpumask.h>
+#include <linux/topology.h>
+#include <linux/timex.h>
+#include <linux/math64.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/poll.h>
+#include <linux/uaccess.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/random.h>
+
+#include "threads_list.h"
 
 #ifdef pr_fmt
 #undef pr_fmt
 #endif
 
-#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#define THREAD_NAME_FMT	"thread/%d"
+
+MODULE_AUTHOR("Kirill Yatsenko <kirill.yatsenko@globallogic.com>");
+MODULE_DESCRIPTION("HM #13");
+MODULE_LICENSE("Dual BSD/GPL");
+
+#define THREADS_MAX		1024
+
+#define BENCH_MAX_THREADS	64
+#define BENCH_MAX_OPS		100000000UL
+
+#define IDENT_BENCH_LOOPS	100000
+
+#define EVENT_RING_ORDER_MIN	4
+#define EVENT_RING_ORDER_MAX	24
+#define EVENT_READ_BATCH	64
+
+#define WAKE_HIST_BUCKETS	40
+
+#define SYNTH_MEM_SIZE		(4UL << 20)
+#define SYNTH_MAX_SIZE		100000
+#define SYNTH_MAX_JOBS		100000
+
+static int nr_threads_set(const char *val, const struct kernel_param *kp);
+
+static const struct kernel_param_ops nr_threads_ops = {
+	.set	= nr_threads_set,
+	.get	= param_get_uint,
+};
+
+static unsigned int nr_threads;
+module_param_cb(nr_threads, &nr_threads_ops, &nr_threads, 0644);
+MODULE_PARM_DESC(nr_threads, "Worker threads in the pool (0 - one per online CPU), resizable at runtime");
+
+static bool numa_spread = true;
+module_param(numa_spread, bool, 0444);
+MODULE_PARM_DESC(numa_spread, "Place workers round-robin over NUMA nodes instead of filling CPUs in order");
+
+static unsigned int ring_order = 16;
+module_param(ring_order, uint, 0444);
+MODULE_PARM_DESC(ring_order, "Event ring holds 2^ring_order events");
+
+static bool work_stealing = true;
+module_param(work_stealing, bool, 0644);
+MODULE_PARM_DESC(work_stealing, "Spread submitted work over per-worker deques instead of one shared queue");
+
+static unsigned int sched_bench_jobs = 20000;
+module_param(sched_bench_jobs, uint, 0644);
+MODULE_PARM_DESC(sched_bench_jobs, "Jobs submitted per mode by the scheduler benchmark");
+
+static unsigned int bench_threads;
+module_param(bench_threads, uint, 0644);
+MODULE_PARM_DESC(bench_threads, "Max threads for the counter benchmark (0 - online CPUs)");
+
+static unsigned long bench_ops = 100000;
+module_param(bench_ops, ulong, 0644);
+MODULE_PARM_DESC(bench_ops, "Increments done by every benchmark thread");
+
+/*
+ * Sharded counter: every CPU bumps its own cache line and readers fold the
+ * shards. shard_counter_read() reuses the last fold for up to fold_interval
+ * jiffies, shard_counter_read_exact() always walks all the CPUs and sees
+ * every increment completed before the call.
+ */
+struct shard_slot {
+	unsigned long count;
+} ____cacheline_aligned_in_smp;
+
+struct shard_counter {
+	struct shard_slot __percpu *slots;
+	unsigned long folded;
+	unsigned long fold_stamp;
+	unsigned long fold_interval;
+};
+
+/*
+ * Work deque of one worker. The owner pops from the tail, thieves from
+ * the head; @nr lets thieves skip empty deques without the lock.
+ */
+struct work_deque {
+	spinlock_t lock;
+	struct list_head items;
+	unsigned int nr;
+} ____cacheline_aligned_in_smp;
+
+/*
+ * Per-worker context handed to the thread through kthread_create() data.
+ * It is allocated on the worker's node and only written by its owner,
+ * except for @idle_node and @kick_ns which belong to work_lock and
+ * @deque which has its own lock.
+ * wake_hist[i] counts wakeups that took [2^(i-1), 2^i) ns from the kick
+ * by a submitter until the worker ran.
+ */
+struct thread_ctx {
+	struct task_struct *task;
+	unsigned int index;
+	unsigned int cpu;
+	unsigned long iterations;
+	unsigned long steals;
+	struct list_head idle_node;
+	u64 kick_ns;
+	unsigned long wake_hist[WAKE_HIST_BUCKETS];
+	struct work_deque deque;
+} ____cacheline_aligned_in_smp;
+
+/* Record returned by read() on /dev/threads_list */
+struct thread_event {
+	__u64 ts_ns;
+	__u64 value;
+	__u32 thread;
+	__u32 cpu;
+};
+
+/*
+ * Bounded multi-producer single-consumer ring. A slot's sequence tells who
+ * owns it: seq == pos means free for the producer that claims pos, seq ==
+ * pos + 1 means published for the consumer. Producers claim slots with a
+ * cmpxchg on head and never take a lock, a full ring drops the event.
+ * The consumer side is serialized by read_lock.
+ */
+struct event_slot {
+	unsigned long seq;
+	struct thread_event ev;
+};
+
+struct event_ring {
+	struct event_slot *slots;
+	unsigned long mask;
+	atomic_long_t dropped;
+	atomic_long_t head ____cacheline_aligned_in_smp;
+	unsigned long tail ____cacheline_aligned_in_smp;
+	struct mutex read_lock;
+	struct thread_event batch[EVENT_READ_BATCH];
+};
+
+static struct shard_counter counter;
+static struct event_ring events;
+
+/*
+ * Worker pool, protected by pool_mutex. tasks[0..tasks_nr) are active,
+ * tasks[tasks_nr..tasks_created) are parked.
+ */
+static struct thread_ctx *tasks[THREADS_MAX];
+static unsigned int tasks_nr;
+static unsigned int tasks_created;
+static bool pool_live;
+static DEFINE_MUTEX(pool_mutex);
+
+/*
+ * Shared queue, used for submissions without work_stealing or without a
+ * target worker, and sleeping workers, most recently idled first.
+ */
+static DEFINE_SPINLOCK(work_lock);
+static LIST_HEAD(work_list);
+static LIST_HEAD(idle_list);
+
+DECLARE_WAIT_QUEUE_HEAD(deinit_queue);
+
+static struct dentry *root_dentry;
+
+/* Returns the n-th online CPU of @mask, wrapping around its weight */
+static unsigned int nth_online_cpu(const struct cpumask *mask, unsigned int n)
+{
+	unsigned int weight = 0;
+	unsigned int cpu;
+
+	for_each_cpu_and(cpu, mask, cpu_online_mask)
+		weight++;
+
+	if (!weight)
+		return cpumask_first(cpu_online_mask);
+
+	n %= weight;
+
+	for_each_cpu_and(cpu, mask, cpu_online_mask)
+		if (!n--)
+			break;
+
+	return cpu;
+}
+
+static int shard_counter_init(struct shard_counter *c,
+			      unsigned long fold_interval)
+{
+	c->slots = alloc_percpu(struct shard_slot);
+	if (!c->slots)
+		return -ENOMEM;
+
+	c->folded = 0;
+	c->fold_stamp = jiffies;
+	c->fold_interval = fold_interval;
+
+	return 0;
+}
+
+static void shard_counter_destroy(struct shard_counter *c)
+{
+	free_percpu(c->slots);
+	c->slots = NULL;
+}
+
+static inline void shard_counter_inc(struct shard_counter *c)
+{
+	this_cpu_inc(c->slots->count);
+}
+
+static void shard_counter_reset(struct shard_counter *c)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		WRITE_ONCE(per_cpu_ptr(c->slots, cpu)->count, 0);
+
+	WRITE_ONCE(c->folded, 0);
+	WRITE_ONCE(c->fold_stamp, jiffies);
+}
+
+static unsigned long shard_counter_read_exact(struct shard_counter *c)
+{
+	unsigned long sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += READ_ONCE(per_cpu_ptr(c->slots, cpu)->count);
+
+	WRITE_ONCE(c->folded, sum);
+	WRITE_ONCE(c->fold_stamp, jiffies);
+
+	return sum;
+}
+
+static unsigned long shard_counter_read(struct shard_counter *c)
+{
+	if (time_before(jiffies, READ_ONCE(c->fold_stamp) + c->fold_interval))
+		return READ_ONCE(c->folded);
+
+	return shard_counter_read_exact(c);
+}
+
+static int event_ring_init(struct event_ring *r, unsigned int order)
+{
+	unsigned long size;
+	unsigned long i;
+
+	order = clamp_t(unsigned int, order, EVENT_RING_ORDER_MIN,
+			EVENT_RING_ORDER_MAX);
+	size = 1UL << order;
+
+	r->slots = kvmalloc_array(size, sizeof(*r->slots), GFP_KERNEL);
+	if (!r->slots)
+		return -ENOMEM;
+
+	for (i = 0; i < size; i++)
+		r->slots[i].seq = i;
+
+	r->mask = size - 1;
+	r->tail = 0;
+	atomic_long_set(&r->head, 0);
+	atomic_long_set(&r->dropped, 0);
+	mutex_init(&r->read_lock);
+
+	return 0;
+}
+
+static void event_ring_destroy(struct event_ring *r)
+{
+	kvfree(r->slots);
+	r->slots = NULL;
+}
+
+static bool event_ring_empty(struct event_ring *r)
+{
+	unsigned long tail = READ_ONCE(r->tail);
+
+	return smp_load_acquire(&r->slots[tail & r->mask].seq) != tail + 1;
+}
+
+static bool event_ring_push(struct event_ring *r, const struct thread_event *ev)
+{
+	struct event_slot *slot;
+	long pos = atomic_long_read(&r->head);
+	long diff;
+
+	for (;;) {
+		slot = &r->slots[pos & r->mask];
+		diff = (long)smp_load_acquire(&slot->seq) - pos;
+
+		if (!diff) {
+			if (atomic_long_try_cmpxchg(&r->head, &pos, pos + 1))
+				break;
+		} else if (diff < 0) {
+			atomic_long_inc(&r->dropped);
+			return false;
+		} else {
+			pos = atomic_long_read(&r->head);
+		}
+	}
+
+	slot->ev = *ev;
+	smp_store_release(&slot->seq, pos + 1);
+
+	/*
+	 * The consumer only sleeps on an unpublished slot at its tail, so
+	 * only the producer that fills that slot has to wake it.
+	 */
+	smp_mb();
+	if (pos == READ_ONCE(r->tail) && waitqueue_active(&deinit_queue))
+		wake_up_interruptible(&deinit_queue);
+
+	return true;
+}
+
+/* Caller holds read_lock */
+static size_t event_ring_pop(struct event_ring *r, struct thread_event *out,
+			     size_t max)
+{
+	struct event_slot *slot;
+	unsigned long tail = r->tail;
+	size_t n = 0;
+
+	while (n < max) {
+		slot = &r->slots[tail & r->mask];
+		if (smp_load_acquire(&slot->seq) != tail + 1)
+			break;
+
+		out[n++] = slot->ev;
+		smp_store_release(&slot->seq, tail + r->mask + 1);
+		tail++;
+	}
+
+	WRITE_ONCE(r->tail, tail);
+
+	return n;
+}
+
+static void thread_event_emit(unsigned int thread, u64 value)
+{
+	struct thread_event ev = {
+		.ts_ns	= ktime_get_ns(),
+		.value	= value,
+		.thread	= thread,
+		.cpu	= raw_smp_processor_id(),
+	};
+
+	event_ring_push(&events, &ev);
+}
+
+/* Caller holds work_lock */
+static void wake_idle_worker(u64 now)
+{
+	struct thread_ctx *ctx;
+
+	ctx = list_first_entry_or_null(&idle_list, struct thread_ctx,
+				       idle_node);
+	if (!ctx)
+		return;
+
+	list_del_init(&ctx->idle_node);
+	ctx->kick_ns = now;
+	wake_up_process(ctx->task);
+}
+
+static void deque_push(struct work_deque *dq, struct threads_work *work)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&dq->lock, flags);
+	list_add_tail(&work->node, &dq->items);
+	WRITE_ONCE(dq->nr, dq->nr + 1);
+	spin_unlock_irqrestore(&dq->lock, flags);
+}
+
+/* The owner works LIFO on the hot end, thieves take the cold end */
+static struct threads_work *deque_pop(struct work_deque *dq, bool steal)
+{
+	struct threads_work *work = NULL;
+
+	if (!READ_ONCE(dq->nr))
+		return NULL;
+
+	spin_lock_irq(&dq->lock);
+	if (!list_empty(&dq->items)) {
+		work = steal ? list_first_entry(&dq->items,
+						struct threads_work, node) :
+			       list_last_entry(&dq->items,
+					       struct threads_work, node);
+		list_del(&work->node);
+		WRITE_ONCE(dq->nr, dq->nr - 1);
+	}
+	spin_unlock_irq(&dq->lock);
+
+	return work;
+}
+
+static struct threads_work *work_list_pop(void)
+{
+	struct threads_work *work;
+
+	spin_lock_irq(&work_lock);
+	work = list_first_entry_or_null(&work_list, struct threads_work, node);
+	if (work)
+		list_del(&work->node);
+	spin_unlock_irq(&work_lock);
+
+	return work;
+}
+
+/* Caller holds work_lock */
+static bool pool_has_work(void)
+{
+	unsigned int nr = smp_load_acquire(&tasks_created);
+	unsigned int i;
+
+	if (!list_empty(&work_list))
+		return true;
+
+	for (i = 0; i < nr; i++)
+		if (READ_ONCE(tasks[i]->deque.nr))
+			return true;
+
+	return false;
+}
+
+static void submit_kick(u64 now)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&work_lock, flags);
+	wake_idle_worker(now);
+	spin_unlock_irqrestore(&work_lock, flags);
+}
+
+/*
+ * Queue @work on the deque of worker @thread and wake one idle worker,
+ * if there is any. The owner runs it unless somebody steals it first.
+ * Safe to call from any context.
+ */
+void threads_list_submit_on(struct threads_work *work, unsigned int thread)
+{
+	unsigned int nr = smp_load_acquire(&tasks_created);
+
+	work->submit_ns = ktime_get_ns();
+
+	if (thread >= nr) {
+		unsigned long flags;
+
+		spin_lock_irqsave(&work_lock, flags);
+		list_add_tail(&work->node, &work_list);
+		wake_idle_worker(work->submit_ns);
+		spin_unlock_irqrestore(&work_lock, flags);
+		return;
+	}
+
+	deque_push(&tasks[thread]->deque, work);
+	submit_kick(work->submit_ns);
+}
+EXPORT_SYMBOL_GPL(threads_list_submit_on);
+
+/* Round-robin over the active workers' deques if @steal, shared queue otherwise */
+static void submit_mode(struct threads_work *work, bool steal)
+{
+	static atomic_t next_thread = ATOMIC_INIT(0);
+	unsigned int nr = smp_load_acquire(&tasks_nr);
+	unsigned int thread = UINT_MAX;
+
+	if (steal && nr)
+		thread = (unsigned int)atomic_inc_return(&next_thread) % nr;
+
+	threads_list_submit_on(work, thread);
+}
+
+/*
+ * Queue @work for the pool: round-robin over the active workers' deques
+ * with work_stealing, on the shared queue otherwise. Wakes one idle
+ * worker, if there is any. Safe to call from any context.
+ */
+void threads_list_submit(struct threads_work *work)
+{
+	submit_mode(work, READ_ONCE(work_stealing));
+}
+EXPORT_SYMBOL_GPL(threads_list_submit);
+
+static void worker_account_wakeup(struct thread_ctx *ctx)
+{
+	unsigned int bucket;
+	u64 kick_ns;
+
+	spin_lock_irq(&work_lock);
+	if (!list_empty(&ctx->idle_node)) {
+		/* Woken by stop or park, not by a submitter */
+		list_del_init(&ctx->idle_node);
+		spin_unlock_irq(&work_lock);
+		return;
+	}
+	kick_ns = ctx->kick_ns;
+	spin_unlock_irq(&work_lock);
+
+	bucket = min_t(unsigned int, fls64(ktime_get_ns() - kick_ns),
+		       WAKE_HIST_BUCKETS - 1);
+	WRITE_ONCE(ctx->wake_hist[bucket], ctx->wake_hist[bucket] + 1);
+}
+
+static struct threads_work *worker_steal(struct thread_ctx *ctx)
+{
+	unsigned int nr = smp_load_acquire(&tasks_created);
+	struct threads_work *work;
+	unsigned int i;
+
+	/* Start next to ourselves so thieves spread over the victims */
+	for (i = 1; i < nr; i++) {
+		work = deque_pop(&tasks[(ctx->index + i) % nr]->deque, true);
+		if (work) {
+			WRITE_ONCE(ctx->steals, ctx->steals + 1);
+			return work;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Returns the next work item: own deque first, then the shared queue,
+ * then a steal. Without one the worker is queued on idle_list with its
+ * state set to sleep and @idle is set, unless it has to stop or park.
+ */
+static struct threads_work *worker_next(struct thread_ctx *ctx, bool *idle)
+{
+	struct threads_work *work;
+
+	*idle = false;
+
+	work = deque_pop(&ctx->deque, false);
+	if (work)
+		return work;
+
+	work = work_list_pop();
+	if (work)
+		return work;
+
+	work = worker_steal(ctx);
+	if (work)
+		return work;
+
+	spin_lock_irq(&work_lock);
+
+	/* Submitters push before they take work_lock to look for us */
+	set_current_state(TASK_IDLE);
+	if (kthread_should_stop() || kthread_should_park() ||
+	    pool_has_work()) {
+		__set_current_state(TASK_RUNNING);
+		goto out;
+	}
+
+	list_add(&ctx->idle_node, &idle_list);
+	*idle = true;
+out:
+	spin_unlock_irq(&work_lock);
+	return NULL;
+}
+
+static int worker_thread(void *data)
+{
+	struct thread_ctx *ctx = data;
+	struct threads_work *work;
+	bool idle;
+
+	while (!kthread_should_stop()) {
+		if (kthread_should_park()) {
+			/* Hand a kick we may have swallowed to another worker */
+			spin_lock_irq(&work_lock);
+			if (pool_has_work())
+				wake_idle_worker(ktime_get_ns());
+			spin_unlock_irq(&work_lock);
+
+			kthread_parkme();
+			continue;
+		}
+
+		work = worker_next(ctx, &idle);
+		if (work) {
+			work->thread = ctx->index;
+			work->func(work);
+			WRITE_ONCE(ctx->iterations, ctx->iterations + 1);
+			continue;
+		}
+
+		if (!idle)
+			continue;
+
+		schedule();
+		worker_account_wakeup(ctx);
+	}
+
+	pr_info("Stoping thread: %u\n", ctx->index);
+
+	return 0;
+}
+
+/* Runs whatever is still queued once the workers are gone */
+static void work_list_flush(void)
+{
+	struct threads_work *work;
+
+	while ((work = work_list_pop())) {
+		work->thread = UINT_MAX;
+		work->func(work);
+	}
+}
+
+/* Moves the items of a stopped worker to the shared queue */
+static void deque_drain(struct work_deque *dq)
+{
+	spin_lock_irq(&work_lock);
+	spin_lock(&dq->lock);
+	list_splice_tail_init(&dq->items, &work_list);
+	WRITE_ONCE(dq->nr, 0);
+	spin_unlock(&dq->lock);
+	spin_unlock_irq(&work_lock);
+}
+
+/* Work submitted through debugfs: bump the counter and emit an event */
+static void counter_work_func(struct threads_work *work)
+{
+	shard_counter_inc(&counter);
+	thread_event_emit(work->thread, shard_counter_read(&counter));
+	kfree(work);
+}
+
+/* Synthetic jobs injected through debugfs and run by sched_bench */
+enum synth_kind {
+	SYNTH_CPU,
+	SYNTH_MEM,
+};
+
+struct synth_batch {
+	atomic_t remaining;
+	struct completion done;
+};
+
+/* Jobs without a batch are freed when done, batch jobs belong to it */
+struct synth_job {
+	struct threads_work work;
+	enum synth_kind kind;
+	unsigned int size;	/* us for SYNTH_CPU, KiB for SYNTH_MEM */
+	struct synth_batch *batch;
+};
+
+static u8 *synth_mem;
+
+static void synth_cpu(unsigned int usecs)
+{
+	u64 end = ktime_get_ns() + (u64)usecs * NSEC_PER_USEC;
+
+	while (ktime_get_ns() < end)
+		cpu_relax();
+}
+
+static void synth_mem_walk(unsigned int kib)
+{
+	size_t len = min_t(size_t, (size_t)kib << 10, SYNTH_MEM_SIZE);
+	size_t start;
+	size_t off;
+
+	start = get_random_u32() % (SYNTH_MEM_SIZE - len + 1);
+	start &= ~(size_t)(SMP_CACHE_BYTES - 1);
+
+	for (off = start; off < start + len; off += SMP_CACHE_BYTES)
+		synth_mem[off]++;
+}
+
+static void synth_job_func(struct threads_work *work)
+{
+	struct synth_job *job = container_of(work, struct synth_job, work);
+	struct synth_batch *batch = job->batch;
+
+	if (job->kind == SYNTH_CPU)
+		synth_cpu(job->size);
+	else
+		synth_mem_walk(job->size);
+
+	if (!batch)
+		kfree(job);
+	else if (atomic_dec_and_test(&batch->remaining))
+		complete(&batch->done);
+}
+
+/* Scheduler benchmark: shared queue vs work stealing on the same job mix */
+struct sched_bench_result {
+	unsigned int jobs;
+	u64 makespan_ns;
+	u64 jobs_per_sec;
+	unsigned long steals;
+};
+
+static struct sched_bench_result sched_results[2];
+
+static unsigned long pool_steals(void)
+{
+	unsigned long steals = 0;
+	unsigned int i;
+
+	mutex_lock(&pool_mutex);
+	for (i = 0; i < tasks_created; i++)
+		steals += READ_ONCE(tasks[i]->steals);
+	mutex_unlock(&pool_mutex);
+
+	return steals;
+}
+
+static int sched_bench_run(bool steal, struct sched_bench_result *res)
+{
+	unsigned int nr = sched_bench_jobs;
+	struct synth_batch batch;
+	struct synth_job *jobs;
+	struct rnd_state rnd;
+	unsigned long steals;
+	ktime_t start;
+	unsigned int i;
+	u32 r;
+
+	if (!nr || !READ_ONCE(tasks_nr))
+		return -ENODEV;
+
+	jobs = kvcalloc(nr, sizeof(*jobs), GFP_KERNEL);
+	if (!jobs)
+		return -ENOMEM;
+
+	/* Same uneven mix for both modes: 1..128 us or 4..512 KiB */
+	prandom_seed_state(&rnd, 13);
+	for (i = 0; i < nr; i++) {
+		r = prandom_u32_state(&rnd);
+		jobs[i].work.func = synth_job_func;
+		jobs[i].kind = r & 1 ? SYNTH_CPU : SYNTH_MEM;
+		jobs[i].size = (jobs[i].kind == SYNTH_CPU ? 1 : 4) <<
+			       ((r >> 1) % 8);
+		jobs[i].batch = &batch;
+	}
+
+	atomic_set(&batch.remaining, nr);
+	init_completion(&batch.done);
+
+	steals = pool_steals();
+
+	/* The mode only applies to these jobs, work_stealing is left alone */
+	start = ktime_get();
+	for (i = 0; i < nr; i++)
+		submit_mode(&jobs[i].work, steal);
+	wait_for_completion(&batch.done);
+
+	res->makespan_ns = ktime_to_ns(ktime_sub(ktime_get(), start)) ?: 1;
+	res->jobs = nr;
+	res->jobs_per_sec = div64_u64((u64)nr * NSEC_PER_SEC,
+				      res->makespan_ns);
+	res->steals = pool_steals() - steals;
+
+	kvfree(jobs);
+
+	return 0;
+}
+
+/* Counter benchmark: spinlock vs atomic64 vs sharded per-CPU counter */
+enum bench_kind {
+	BENCH_SPINLOCK,
+	BENCH_ATOMIC64,
+	BENCH_PERCPU,
+	BENCH_NR,
+};
+
+static const char * const bench_names[BENCH_NR] = {
+	[BENCH_SPINLOCK] = "spinlock",
+	[BENCH_ATOMIC64] = "atomic64",
+	[BENCH_PERCPU]	 = "percpu",
+};
+
+struct bench_run {
+	enum bench_kind kind;
+	unsigned long ops;
+	atomic_t remaining;
+	struct completion start;
+	struct completion done;
+	ktime_t end;
+};
+
+static DEFINE_SPINLOCK(bench_lock);
+static unsigned long bench_plain;
+static atomic64_t bench_atomic;
+static struct shard_counter bench_shard;
+
+static DEFINE_MUTEX(bench_mutex);
+static u64 bench_results[BENCH_NR][BENCH_MAX_THREADS];
+static unsigned int bench_last_threads;
+
+static int bench_thread(void *data)
+{
+	struct bench_run *run = data;
+	unsigned long i;
+
+	wait_for_completion(&run->start);
+
+	switch (run->kind) {
+	case BENCH_SPINLOCK:
+		for (i = 0; i < run->ops; i++) {
+			spin_lock(&bench_lock);
+			bench_plain++;
+			spin_unlock(&bench_lock);
+			if (!(i & 1023))
+				cond_resched();
+		}
+		break;
+	case BENCH_ATOMIC64:
+		for (i = 0; i < run->ops; i++) {
+			atomic64_inc(&bench_atomic);
+			if (!(i & 1023))
+				cond_resched();
+		}
+		break;
+	case BENCH_PERCPU:
+		for (i = 0; i < run->ops; i++) {
+			shard_counter_inc(&bench_shard);
+			if (!(i & 1023))
+				cond_resched();
+		}
+		break;
+	default:
+		break;
+	}
+
+	if (atomic_dec_and_test(&run->remaining)) {
+		run->end = ktime_get();
+		complete(&run->done);
+	}
+
+	return 0;
+}
+
+static u64 bench_total(enum bench_kind kind)
+{
+	switch (kind) {
+	case BENCH_SPINLOCK:
+		return bench_plain;
+	case BENCH_ATOMIC64:
+		return atomic64_read(&bench_atomic);
+	case BENCH_PERCPU:
+		return shard_counter_read_exact(&bench_shard);
+	default:
+		return 0;
+	}
+}
+
+static int bench_run_one(enum bench_kind kind, unsigned int nr_threads,
+			 u64 *ops_per_sec)
+{
+	struct task_struct **threads;
+	struct bench_run run;
+	unsigned int created;
+	unsigned int i;
+	ktime_t start;
+	u64 elapsed;
+	u64 total;
+	int ret = 0;
+
+	threads = kcalloc(nr_threads, sizeof(*threads), GFP_KERNEL);
+	if (!threads)
+		return -ENOMEM;
+
+	run.kind = kind;
+	run.ops = min(bench_ops, BENCH_MAX_OPS);
+	atomic_set(&run.remaining, nr_threads);
+	init_completion(&run.start);
+	init_completion(&run.done);
+
+	bench_plain = 0;
+	atomic64_set(&bench_atomic, 0);
+	shard_counter_reset(&bench_shard);
+
+	for (created = 0; created < nr_threads; created++) {
+		struct task_struct *thread;
+
+		thread = kthread_create(bench_thread, &run, "tl_bench/%u",
+					created);
+		if (IS_ERR(thread)) {
+			ret = PTR_ERR(thread);
+			pr_err("Unable to create bench thread: %u ret: %d\n",
+			       created, ret);
+			goto stop;
+		}
+
+		get_task_struct(thread);
+		kthread_bind(thread, nth_online_cpu(cpu_online_mask, created));
+		threads[created] = thread;
+	}
+
+	for (i = 0; i < nr_threads; i++)
+		wake_up_process(threads[i]);
+
+	start = ktime_get();
+	complete_all(&run.start);
+	wait_for_completion(&run.done);
+
+	elapsed = ktime_to_ns(ktime_sub(run.end, start)) ?: 1;
+	total = (u64)nr_threads * run.ops;
+	*ops_per_sec = div64_u64(total * NSEC_PER_SEC, elapsed);
+
+	if (bench_total(kind) != total)
+		pr_warn("%s: lost increments, expected %llu got %llu\n",
+			bench_names[kind], total, bench_total(kind));
+
+stop:
+	/* Threads that were never woken exit without running bench_thread() */
+	for (i = 0; i < created; i++) {
+		kthread_stop(threads[i]);
+		put_task_struct(threads[i]);
+	}
+
+	kfree(threads);
+	return ret;
+}
+
+static int bench_run_all(void)
+{
+	unsigned int max_threads = bench_threads ?: num_online_cpus();
+	unsigned int n;
+	int kind;
+	int ret;
 
-#define THREAD_NAME_FMT	"thread/%d"
+	max_threads = min_t(unsigned int, max_threads, BENCH_MAX_THREADS);
 
-MODULE_AUTHOR("Kirill Yatsenko <kirill.yatsenko@globallogic.com>");
-MODULE_DESCRIPTION("HM #13");
-MODULE_LICENSE("Dual BSD/GPL");
+	memset(bench_results, 0, sizeof(bench_results));
+	bench_last_threads = 0;
+
+	for (n = 1; n <= max_threads; n++) {
+		for (kind = 0; kind < BENCH_NR; kind++) {
+			ret = bench_run_one(kind, n, &bench_results[kind][n - 1]);
+			if (ret)
+				return ret;
+		}
+		bench_last_threads = n;
+	}
+
+	return 0;
+}
+
+static int bench_show(struct seq_file *s, void *unused)
+{
+	unsigned int n;
+	int kind;
 
-static unsigned long counter;
-struct task_struct *tasks[5];
+	mutex_lock(&bench_mutex);
 
-DEFINE_SPINLOCK(lock);
-DECLARE_WAIT_QUEUE_HEAD(deinit_queue);
+	if (!bench_last_threads) {
+		seq_puts(s, "no results, write 1 to run the benchmark\n");
+		goto out;
+	}
+
+	seq_printf(s, "%7s", "threads");
+	for (kind = 0; kind < BENCH_NR; kind++)
+		seq_printf(s, " %14s", bench_names[kind]);
+	seq_puts(s, "  (ops/sec)\n");
+
+	for (n = 0; n < bench_last_threads; n++) {
+		seq_printf(s, "%7u", n + 1);
+		for (kind = 0; kind < BENCH_NR; kind++)
+			seq_printf(s, " %14llu", bench_results[kind][n]);
+		seq_putc(s, '\n');
+	}
+
+out:
+	mutex_unlock(&bench_mutex);
+	return 0;
+}
+
+static int bench_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, bench_show, inode->i_private);
+}
 
-static int inc_thread(void *data)
+static ssize_t bench_write(struct file *file, const char __user *buf,
+			   size_t count, loff_t *ppos)
 {
 	int ret;
-	int thread_i;
-	unsigned long delay = msecs_to_jiffies(5000);
 
-	while (true) {
-		spin_lock(&lock);
-		pr_info("Global counter: %ld\n", ++counter);
-		spin_unlock(&lock);
+	ret = mutex_lock_interruptible(&bench_mutex);
+	if (ret)
+		return ret;
 
-		ret = sscanf(current->comm, THREAD_NAME_FMT, &thread_i);
-		if (ret != 1) {
-			pr_err("Unable to get task number\n");
-		} else {
-			if (!(thread_i % 5))
-				pr_info("=========================\n");
+	ret = bench_run_all();
+	mutex_unlock(&bench_mutex);
 
-			pr_info("Thread number: %d\n", thread_i);
-		}
+	if (ret) {
+		pr_err("Counter benchmark failed: %d\n", ret);
+		return ret;
+	}
 
-		ret = wait_event_timeout(deinit_queue, kthread_should_stop(),
-					 delay);
-		if (ret) {
-			pr_info("Stoping thread: '%s'\n", current->comm);
-			return 0;
-		}
+	return count;
+}
+
+static const struct file_operations bench_fops = {
+	.owner		= THIS_MODULE,
+	.open		= bench_open,
+	.read		= seq_read,
+	.write		= bench_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int counter_get(void *data, u64 *val)
+{
+	*val = shard_counter_read(data);
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(counter_fops, counter_get, NULL, "%llu\n");
+
+static int counter_exact_get(void *data, u64 *val)
+{
+	*val = shard_counter_read_exact(data);
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(counter_exact_fops, counter_exact_get, NULL,
+			 "%llu\n");
+
+static int threads_show(struct seq_file *s, void *unused)
+{
+	struct thread_ctx *ctx;
+	unsigned int i;
+
+	mutex_lock(&pool_mutex);
+
+	seq_printf(s, "%6s %5s %7s %12s %10s %6s\n", "thread", "cpu",
+		   "state", "iterations", "steals", "queued");
+	for (i = 0; i < tasks_created; i++) {
+		ctx = tasks[i];
+		seq_printf(s, "%6u %5u %7s %12lu %10lu %6u\n", ctx->index,
+			   ctx->cpu, i < tasks_nr ? "active" : "parked",
+			   READ_ONCE(ctx->iterations), READ_ONCE(ctx->steals),
+			   READ_ONCE(ctx->deque.nr));
 	}
 
+	mutex_unlock(&pool_mutex);
 	return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(threads);
 
-static void threads_array_deinit(void)
+static int wakeup_latency_show(struct seq_file *s, void *unused)
 {
-	int i;
-	size_t array_size = ARRAY_SIZE(tasks);
+	unsigned long hist[WAKE_HIST_BUCKETS] = {};
+	unsigned int i, b;
 
-	for (i = 0; i < array_size; i++)
-		if (tasks[i])
-			kthread_stop(tasks[i]);
+	mutex_lock(&pool_mutex);
+	for (i = 0; i < tasks_created; i++)
+		for (b = 0; b < WAKE_HIST_BUCKETS; b++)
+			hist[b] += READ_ONCE(tasks[i]->wake_hist[b]);
+	mutex_unlock(&pool_mutex);
 
-	pr_info("Threads were deinited\n");
+	seq_printf(s, "%14s %12s\n", "< ns", "wakeups");
+	for (b = 0; b < WAKE_HIST_BUCKETS; b++)
+		if (hist[b])
+			seq_printf(s, "%14llu %12lu\n", 1ULL << b, hist[b]);
+
+	return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(wakeup_latency);
 
-static int threads_array_init(void)
+/* Writing N queues N counter work items, up to SYNTH_MAX_JOBS */
+static ssize_t submit_write(struct file *file, const char __user *buf,
+			    size_t count, loff_t *ppos)
+{
+	struct threads_work *work;
+	unsigned int nr;
+	int ret;
+
+	ret = kstrtouint_from_user(buf, count, 0, &nr);
+	if (ret)
+		return ret;
+
+	if (nr > SYNTH_MAX_JOBS)
+		return -ERANGE;
+
+	while (nr--) {
+		work = kzalloc(sizeof(*work), GFP_KERNEL);
+		if (!work)
+			return -ENOMEM;
+
+		work->func = counter_work_func;
+		threads_list_submit(work);
+		cond_resched();
+	}
+
+	return count;
+}
+
+static const struct file_operations submit_fops = {
+	.owner	= THIS_MODULE,
+	.open	= simple_open,
+	.write	= submit_write,
+};
+
+/*
+ * Writing "cpu <count> <usecs>" or "mem <count> <KiB>" queues count
+ * synthetic CPU-bound or memory-bound jobs of the given size.
+ */
+static ssize_t inject_write(struct file *file, const char __user *buf,
+			    size_t count, loff_t *ppos)
+{
+	struct synth_job *job;
+	enum synth_kind kind;
+	char kbuf[32] = {};
+	char name[4];
+	unsigned int nr;
+	unsigned int size;
+
+	if (count >= sizeof(kbuf))
+		return -EINVAL;
+
+	if (copy_from_user(kbuf, buf, count))
+		return -EFAULT;
+
+	if (sscanf(kbuf, "%3s %u %u", name, &nr, &size) != 3)
+		return -EINVAL;
+
+	if (!strcmp(name, "cpu"))
+		kind = SYNTH_CPU;
+	else if (!strcmp(name, "mem"))
+		kind = SYNTH_MEM;
+	else
+		return -EINVAL;
+
+	if (size > SYNTH_MAX_SIZE || nr > SYNTH_MAX_JOBS)
+		return -ERANGE;
+
+	while (nr--) {
+		job = kzalloc(sizeof(*job), GFP_KERNEL);
+		if (!job)
+			return -ENOMEM;
+
+		job->work.func = synth_job_func;
+		job->kind = kind;
+		job->size = size;
+		threads_list_submit(&job->work);
+		cond_resched();
+	}
+
+	return count;
+}
+
+static const struct file_operations inject_fops = {
+	.owner	= THIS_MODULE,
+	.open	= simple_open,
+	.write	= inject_write,
+};
+
+static int sched_bench_show(struct seq_file *s, void *unused)
 {
+	static const char * const modes[] = { "shared", "stealing" };
+	struct sched_bench_result *res;
 	int i;
+
+	mutex_lock(&bench_mutex);
+
+	if (!sched_results[0].jobs) {
+		seq_puts(s, "no results, write 1 to run the benchmark\n");
+		goto out;
+	}
+
+	seq_printf(s, "%-8s %8s %14s %12s %10s\n", "mode", "jobs",
+		   "makespan_ns", "jobs/sec", "steals");
+	for (i = 0; i < ARRAY_SIZE(sched_results); i++) {
+		res = &sched_results[i];
+		seq_printf(s, "%-8s %8u %14llu %12llu %10lu\n", modes[i],
+			   res->jobs, res->makespan_ns, res->jobs_per_sec,
+			   res->steals);
+	}
+
+out:
+	mutex_unlock(&bench_mutex);
+	return 0;
+}
+
+static int sched_bench_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, sched_bench_show, inode->i_private);
+}
+
+static ssize_t sched_bench_write(struct file *file, const char __user *buf,
+				 size_t count, loff_t *ppos)
+{
 	int ret;
-	struct task_struct *thread;
-	size_t array_size = ARRAY_SIZE(tasks);
 
-	for (i = 0; i < array_size; i++) {
-		thread = kthread_create(inc_thread, NULL, THREAD_NAME_FMT, i);
-		if (IS_ERR(thread)) {
-			ret = PTR_ERR(thread);
-			pr_err("Error while creating thread: %d ret: %d\n", i,
-			       ret);
-			goto err;
+	ret = mutex_lock_interruptible(&bench_mutex);
+	if (ret)
+		return ret;
+
+	memset(sched_results, 0, sizeof(sched_results));
+	ret = sched_bench_run(false, &sched_results[0]);
+	if (!ret)
+		ret = sched_bench_run(true, &sched_results[1]);
+	if (ret)
+		memset(sched_results, 0, sizeof(sched_results));
+
+	mutex_unlock(&bench_mutex);
+
+	if (ret) {
+		pr_err("Scheduler benchmark failed: %d\n", ret);
+		return ret;
+	}
+
+	return count;
+}
+
+static const struct file_operations sched_bench_fops = {
+	.owner		= THIS_MODULE,
+	.open		= sched_bench_open,
+	.read		= seq_read,
+	.write		= sched_bench_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/* @cyc and @ns are in hundredths per iteration */
+static void ident_bench_print(struct seq_file *s, const char *name, u64 cyc,
+			      u64 ns)
+{
+	u32 cyc_frac, ns_frac;
+	u64 cyc_int, ns_int;
+
+	cyc_int = div_u64_rem(cyc, 100, &cyc_frac);
+	ns_int = div_u64_rem(ns, 100, &ns_frac);
+
+	seq_printf(s, "%-13s %llu.%02u cycles %llu.%02u ns per iteration\n",
+		   name, cyc_int, cyc_frac, ns_int, ns_frac);
+}
+
+/*
+ * Cost of finding out "which worker am I": the old sscanf() of the comm
+ * against a load from the thread context.
+ */
+static int ident_bench_show(struct seq_file *s, void *unused)
+{
+	struct thread_ctx ctx = { .index = 3 };
+	char comm[TASK_COMM_LEN];
+	cycles_t cycles[3];
+	ktime_t time[3];
+	unsigned long sink = 0;
+	int thread_i;
+	u64 scan_cyc, ctx_cyc;
+	u64 scan_ns, ctx_ns;
+	u64 saved;
+	u32 saved_frac;
+	unsigned int i;
+
+	snprintf(comm, sizeof(comm), THREAD_NAME_FMT, ctx.index);
+
+	time[0] = ktime_get();
+	cycles[0] = get_cycles();
+
+	for (i = 0; i < IDENT_BENCH_LOOPS; i++)
+		if (sscanf(comm, THREAD_NAME_FMT, &thread_i) == 1)
+			sink += thread_i;
+
+	cycles[1] = get_cycles();
+	time[1] = ktime_get();
+
+	for (i = 0; i < IDENT_BENCH_LOOPS; i++)
+		sink += READ_ONCE(ctx.index);
+
+	cycles[2] = get_cycles();
+	time[2] = ktime_get();
+
+	/* Hundredths of a cycle/ns per iteration */
+	scan_cyc = div_u64((u64)(cycles[1] - cycles[0]) * 100,
+			   IDENT_BENCH_LOOPS);
+	ctx_cyc = div_u64((u64)(cycles[2] - cycles[1]) * 100,
+			  IDENT_BENCH_LOOPS);
+	scan_ns = div_u64(ktime_to_ns(ktime_sub(time[1], time[0])) * 100,
+			  IDENT_BENCH_LOOPS);
+	ctx_ns = div_u64(ktime_to_ns(ktime_sub(time[2], time[1])) * 100,
+			 IDENT_BENCH_LOOPS);
+
+	seq_printf(s, "loops: %u (sink %lu)\n", IDENT_BENCH_LOOPS, sink);
+	ident_bench_print(s, "sscanf(comm):", scan_cyc, scan_ns);
+	ident_bench_print(s, "ctx->index:", ctx_cyc, ctx_ns);
+
+	saved = div_u64_rem(scan_cyc > ctx_cyc ? scan_cyc - ctx_cyc : 0, 100,
+			    &saved_frac);
+	seq_printf(s, "%-13s %llu.%02u cycles per iteration\n", "saved:",
+		   saved, saved_frac);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ident_bench);
+
+static int events_dropped_get(void *data, u64 *val)
+{
+	struct event_ring *r = data;
+
+	*val = atomic_long_read(&r->dropped);
+	return 0;
+}
+DEFINE_DEBUGFS_ATTRIBUTE(events_dropped_fops, events_dropped_get, NULL,
+			 "%llu\n");
+
+static void debugfs_deinit(void)
+{
+	debugfs_remove_recursive(root_dentry);
+	root_dentry = NULL;
+}
+
+static void debugfs_init(void)
+{
+	root_dentry = debugfs_create_dir(KBUILD_MODNAME, NULL);
+	if (IS_ERR_OR_NULL(root_dentry)) {
+		pr_err("Unable to create debugfs dir\n");
+		root_dentry = NULL;
+		return;
+	}
+
+	debugfs_create_file_unsafe("counter", 0444, root_dentry, &counter,
+				   &counter_fops);
+	debugfs_create_file_unsafe("counter_exact", 0444, root_dentry,
+				   &counter, &counter_exact_fops);
+	debugfs_create_file("bench", 0644, root_dentry, NULL, &bench_fops);
+	debugfs_create_file_unsafe("events_dropped", 0444, root_dentry,
+				   &events, &events_dropped_fops);
+	debugfs_create_file("threads", 0444, root_dentry, NULL,
+			    &threads_fops);
+	debugfs_create_file("wakeup_latency", 0444, root_dentry, NULL,
+			    &wakeup_latency_fops);
+	debugfs_create_file("submit", 0200, root_dentry, NULL, &submit_fops);
+	debugfs_create_file("inject", 0200, root_dentry, NULL, &inject_fops);
+	debugfs_create_file("sched_bench", 0644, root_dentry, NULL,
+			    &sched_bench_fops);
+	debugfs_create_file("ident_bench", 0444, root_dentry, NULL,
+			    &ident_bench_fops);
+}
+
+static ssize_t events_read(struct file *file, char __user *buf,
+			   size_t count, loff_t *ppos)
+{
+	struct event_ring *r = &events;
+	size_t max = count / sizeof(struct thread_event);
+	size_t done = 0;
+	size_t n;
+	ssize_t ret;
+
+	if (!max)
+		return -EINVAL;
+
+	ret = mutex_lock_interruptible(&r->read_lock);
+	if (ret)
+		return ret;
+
+	while (event_ring_empty(r)) {
+		mutex_unlock(&r->read_lock);
+
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+
+		ret = wait_event_interruptible(deinit_queue,
+					       !event_ring_empty(r));
+		if (ret)
+			return ret;
+
+		ret = mutex_lock_interruptible(&r->read_lock);
+		if (ret)
+			return ret;
+	}
+
+	while (done < max) {
+		n = event_ring_pop(r, r->batch,
+				   min_t(size_t, max - done, EVENT_READ_BATCH));
+		if (!n)
+			break;
+
+		if (copy_to_user(buf + done * sizeof(struct thread_event),
+				 r->batch, n * sizeof(struct thread_event))) {
+			ret = -EFAULT;
+			goto out;
 		}
 
-		tasks[i] = thread;
+		done += n;
+	}
+
+	ret = done * sizeof(struct thread_event);
+out:
+	mutex_unlock(&r->read_lock);
+	return ret;
+}
+
+static __poll_t events_poll(struct file *file, poll_table *wait)
+{
+	poll_wait(file, &deinit_queue, wait);
+
+	return event_ring_empty(&events) ? 0 : EPOLLIN | EPOLLRDNORM;
+}
+
+static int events_open(struct inode *inode, struct file *file)
+{
+	return stream_open(inode, file);
+}
+
+static const struct file_operations events_fops = {
+	.owner	= THIS_MODULE,
+	.open	= events_open,
+	.read	= events_read,
+	.poll	= events_poll,
+};
+
+static struct miscdevice events_dev = {
+	.minor	= MISC_DYNAMIC_MINOR,
+	.name	= KBUILD_MODNAME,
+	.fops	= &events_fops,
+};
+
+/*
+ * Worker i goes to the i-th CPU. With numa_spread the workers are dealt
+ * round-robin over the nodes that have CPUs, so a small pool still covers
+ * every node. Stacks and contexts are allocated on the worker's own node.
+ */
+static unsigned int thread_cpu(unsigned int i)
+{
+	unsigned int nodes = num_node_state(N_CPU);
+	unsigned int node_i;
+	int node;
+
+	if (!numa_spread || nodes <= 1)
+		return nth_online_cpu(cpu_online_mask, i);
+
+	node_i = i % nodes;
+	for_each_node_state(node, N_CPU)
+		if (!node_i--)
+			break;
+
+	return nth_online_cpu(cpumask_of_node(node), i / nodes);
+}
+
+static int thread_start(unsigned int i)
+{
+	struct thread_ctx *ctx;
+	struct task_struct *thread;
+	unsigned int cpu = thread_cpu(i);
+	int ret;
+
+	ctx = kzalloc_node(sizeof(*ctx), GFP_KERNEL, cpu_to_node(cpu));
+	if (!ctx)
+		return -ENOMEM;
+
+	ctx->index = i;
+	ctx->cpu = cpu;
+	INIT_LIST_HEAD(&ctx->idle_node);
+	spin_lock_init(&ctx->deque.lock);
+	INIT_LIST_HEAD(&ctx->deque.items);
+
+	thread = kthread_create_on_node(worker_thread, ctx, cpu_to_node(cpu),
+					THREAD_NAME_FMT, i);
+	if (IS_ERR(thread)) {
+		ret = PTR_ERR(thread);
+		pr_err("Error while creating thread: %d ret: %d\n", i, ret);
+		kfree(ctx);
+		return ret;
+	}
+
+	kthread_bind(thread, cpu);
+	ctx->task = thread;
+	tasks[i] = ctx;
+	/* Submitters and thieves look at tasks[] without pool_mutex */
+	smp_store_release(&tasks_created, tasks_created + 1);
+
+	ret = wake_up_process(thread);
+	if (!ret) {
+		pr_err("Unable to wake up thread: %d ret: %d\n", i, ret);
+		return -EINVAL;
 	}
 
-	for (i = 0; i < array_size; i++) {
-		ret = wake_up_process(tasks[i]);
-		if (!ret) {
-			pr_err("Unable to wake up thread: %d ret: %d\n", i,
-			       ret);
-			goto err;
+	return 0;
+}
+
+/*
+ * Shrinking parks the surplus workers, growing unparks them before new
+ * ones are created.
+ */
+static int threads_pool_resize(unsigned int nr)
+{
+	int ret = 0;
+
+	lockdep_assert_held(&pool_mutex);
+
+	while (tasks_nr < nr) {
+		if (tasks_nr < tasks_created) {
+			kthread_unpark(tasks[tasks_nr]->task);
+			smp_store_release(&tasks_nr, tasks_nr + 1);
+			continue;
 		}
+
+		ret = thread_start(tasks_nr);
+		if (tasks[tasks_nr])
+			smp_store_release(&tasks_nr, tasks_nr + 1);
+		if (ret)
+			break;
+	}
+
+	while (tasks_nr > nr) {
+		int err;
+
+		WRITE_ONCE(tasks_nr, tasks_nr - 1);
+		err = kthread_park(tasks[tasks_nr]->task);
+		if (err)
+			pr_warn("Unable to park thread: %u ret: %d\n",
+				tasks_nr, err);
+	}
+
+	pr_info("Pool has %u active, %u parked threads\n", tasks_nr,
+		tasks_created - tasks_nr);
+
+	return ret;
+}
+
+static void threads_pool_destroy(void)
+{
+	unsigned int nr = tasks_created;
+	unsigned int i;
+
+	lockdep_assert_held(&pool_mutex);
+
+	/* Stopped workers' deques stay visible to the ones still running */
+	for (i = 0; i < nr; i++)
+		kthread_stop(tasks[i]->task);
+
+	for (i = 0; i < nr; i++)
+		deque_drain(&tasks[i]->deque);
+
+	WRITE_ONCE(tasks_nr, 0);
+	WRITE_ONCE(tasks_created, 0);
+
+	for (i = 0; i < nr; i++) {
+		kfree(tasks[i]);
+		tasks[i] = NULL;
 	}
+}
+
+static unsigned int threads_pool_size(unsigned int nr)
+{
+	return min_t(unsigned int, nr ?: num_online_cpus(), THREADS_MAX);
+}
+
+static int nr_threads_set(const char *val, const struct kernel_param *kp)
+{
+	unsigned int nr;
+	int ret;
+
+	ret = kstrtouint(val, 0, &nr);
+	if (ret)
+		return ret;
+
+	if (nr > THREADS_MAX)
+		return -EINVAL;
+
+	mutex_lock(&pool_mutex);
+	if (pool_live)
+		ret = threads_pool_resize(threads_pool_size(nr));
+	if (!ret)
+		nr_threads = nr;
+	mutex_unlock(&pool_mutex);
+
+	return ret;
+}
+
+static void threads_array_deinit(void)
+{
+	mutex_lock(&pool_mutex);
+	pool_live = false;
+	threads_pool_destroy();
+	mutex_unlock(&pool_mutex);
+
+	work_list_flush();
+
+	pr_info("Threads were deinited\n");
+}
+
+static int threads_array_init(void)
+{
+	int ret;
+
+	mutex_lock(&pool_mutex);
+	ret = threads_pool_resize(threads_pool_size(nr_threads));
+	if (!ret)
+		pool_live = true;
+	mutex_unlock(&pool_mutex);
+
+	if (ret)
+		goto err;
 
 	pr_info("Threads were created and waked up\n");
 
@@ -140,20 +1667,72 @@ static int __init threads_module_init(void)
 {
 	int ret;
 
+	ret = shard_counter_init(&counter, HZ);
+	if (ret) {
+		pr_err("Unable to init counter\n");
+		return ret;
+	}
+
+	ret = shard_counter_init(&bench_shard, HZ);
+	if (ret) {
+		pr_err("Unable to init bench counter\n");
+		goto err_bench;
+	}
+
+	ret = event_ring_init(&events, ring_order);
+	if (ret) {
+		pr_err("Unable to init event ring\n");
+		goto err_ring;
+	}
+
+	synth_mem = vzalloc(SYNTH_MEM_SIZE);
+	if (!synth_mem) {
+		ret = -ENOMEM;
+		pr_err("Unable to allocate synthetic job buffer\n");
+		goto err_synth;
+	}
+
+	ret = misc_register(&events_dev);
+	if (ret) {
+		pr_err("Unable to register events device\n");
+		goto err_misc;
+	}
+
+	debugfs_init();
+
 	ret = threads_array_init();
 	if (ret) {
 		pr_err("Unable to init threads list\n");
-		return ret;
+		goto err_threads;
 	}
 
 	pr_info("Threads list inited\n");
 
 	return 0;
+
+err_threads:
+	debugfs_deinit();
+	misc_deregister(&events_dev);
+err_misc:
+	vfree(synth_mem);
+err_synth:
+	event_ring_destroy(&events);
+err_ring:
+	shard_counter_destroy(&bench_shard);
+err_bench:
+	shard_counter_destroy(&counter);
+	return ret;
 }
 
 static void __exit threads_module_deinit(void)
 {
+	debugfs_deinit();
 	threads_array_deinit();
+	misc_deregister(&events_dev);
+	vfree(synth_mem);
+	event_ring_destroy(&events);
+	shard_counter_destroy(&bench_shard);
+	shard_counter_destroy(&counter);
 	pr_info("Threads list deinited\n");
 }
 
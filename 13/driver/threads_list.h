@@ -0,0 +1,23 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef _THREADS_LIST_H
+#define _THREADS_LIST_H
+
+#include <linux/list.h>
+#include <linux/types.h>
+
+/*
+ * Unit of work run by the pool. The submitter fills @func and keeps the
+ * item alive until @func has been called; @thread tells @func which
+ * worker runs it.
+ */
+struct threads_work {
+	struct list_head node;
+	void (*func)(struct threads_work *work);
+	unsigned int thread;
+	u64 submit_ns;
+};
+
+void threads_list_submit(struct threads_work *work);
+void threads_list_submit_on(struct threads_work *work, unsigned int thread);
+
+#endif /* _THREADS_LIST_H */
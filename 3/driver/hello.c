@@ -31,33 +31,239 @@
 #include <linux/init.h>
 #include <linux/module.h>
 #include <linux/printk.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/timex.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/cpumask.h>
+#include <linux/topology.h>
+#include <linux/math64.h>
 
 MODULE_AUTHOR("Kirill Yatsenko <kirill.yatsenko@globallogic.com>");
 MODULE_DESCRIPTION("HM #1");
 MODULE_LICENSE("Dual BSD/GPL");
 
 static uint count=1;
-module_param(count,int,0660);
+module_param(count,uint,0660);
+MODULE_PARM_DESC(count, "Timed iterations per repetition");
 
-static int print_message(uint num)
+static char *op = "printk";
+module_param(op, charp, 0660);
+MODULE_PARM_DESC(op, "Operation: printk, trace_printk, noop, kmalloc, spinlock");
+
+static uint warmup;
+module_param(warmup, uint, 0660);
+MODULE_PARM_DESC(warmup, "Untimed iterations before the first repetition");
+
+static uint repeat=1;
+module_param(repeat, uint, 0660);
+MODULE_PARM_DESC(repeat, "Number of timed repetitions");
+
+static int cpu=-1;
+module_param(cpu, int, 0660);
+MODULE_PARM_DESC(cpu, "CPU to run on (-1 - don't pin)");
+
+/*
+ * Timed iterations run in chunks of BENCH_CHUNK, with a scheduling point
+ * between chunks outside the timed window.
+ */
+#define BENCH_CHUNK	4096
+#define COUNT_MAX	(1U << 24)
+#define REPEAT_MAX	1000
+
+static DEFINE_SPINLOCK(op_lock);
+
+static void op_printk(void)
+{
+	printk(KERN_INFO "Hello World!\n");
+}
+
+static void op_trace_printk(void)
+{
+	trace_printk("Hello World!\n");
+}
+
+static void op_noop(void)
+{
+	barrier();
+}
+
+static void op_kmalloc(void)
+{
+	kfree(kmalloc(64, GFP_KERNEL));
+}
+
+static void op_spinlock(void)
+{
+	spin_lock(&op_lock);
+	spin_unlock(&op_lock);
+}
+
+struct bench_op {
+	const char *name;
+	void (*run)(void);
+};
+
+static const struct bench_op bench_ops[] = {
+	{ "printk",		op_printk },
+	{ "trace_printk",	op_trace_printk },
+	{ "noop",		op_noop },
+	{ "kmalloc",		op_kmalloc },
+	{ "spinlock",		op_spinlock },
+};
+
+struct bench_run {
+	const struct bench_op *op;
+	uint num;
+	struct completion done;
+	int rc;
+};
+
+static void print_result(const char *name, const char *what, u64 total,
+			 uint num)
+{
+	printk(KERN_INFO "%s: %s: %llu total, %llu per op\n", name, what,
+	       total, div_u64(total, num));
+}
+
+static int print_message(const struct bench_op *bop, uint num)
 {
-	if (!num || (num > 5 && num < 10)) {
+	u64 ns, ns_min = U64_MAX, ns_max = 0;
+	cycles_t cycles, c0;
+	ktime_t start;
+	uint i, n, done, r;
+
+	if (!num) {
 		printk(KERN_WARNING "Count is: %d\n", num);
-	} else if (num > 10) {
-		printk(KERN_ERR "Max num: %d\n", 10);
-		return -EINVAL;
+		return 0;
 	}
 
-	while (num--)
-		printk(KERN_INFO "Hello World!\n");
+	for (i = 0; i < warmup; i++) {
+		bop->run();
+		if (!(i % BENCH_CHUNK))
+			cond_resched();
+	}
+
+	for (r = 0; r < repeat; r++) {
+		ns = 0;
+		cycles = 0;
+
+		for (done = 0; done < num; done += n) {
+			n = min(num - done, (uint)BENCH_CHUNK);
+
+			start = ktime_get();
+			c0 = get_cycles();
+
+			for (i = 0; i < n; i++)
+				bop->run();
+
+			cycles += get_cycles() - c0;
+			ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+
+			cond_resched();
+		}
+
+		ns_min = min(ns_min, ns);
+		ns_max = max(ns_max, ns);
+
+		printk(KERN_INFO "%s: run %u/%u on cpu %d\n", bop->name, r + 1,
+		       repeat, raw_smp_processor_id());
+		print_result(bop->name, "ns", ns, num);
+		print_result(bop->name, "cycles", cycles, num);
+	}
+
+	if (repeat > 1) {
+		print_result(bop->name, "best ns", ns_min, num);
+		print_result(bop->name, "worst ns", ns_max, num);
+	}
 
 	return 0;
 }
 
+static int bench_thread(void *data)
+{
+	struct bench_run *run = data;
+
+	run->rc = print_message(run->op, run->num);
+	complete(&run->done);
+
+	/* Stay around until hello_init() reaps us */
+	set_current_state(TASK_INTERRUPTIBLE);
+	while (!kthread_should_stop()) {
+		schedule();
+		set_current_state(TASK_INTERRUPTIBLE);
+	}
+	__set_current_state(TASK_RUNNING);
+
+	return 0;
+}
+
+static int run_pinned(const struct bench_op *bop, uint num, int on_cpu)
+{
+	struct task_struct *thread;
+	struct bench_run run = {
+		.op	= bop,
+		.num	= num,
+	};
+
+	init_completion(&run.done);
+
+	thread = kthread_create_on_node(bench_thread, &run,
+					cpu_to_node(on_cpu), "hello_bench/%d",
+					on_cpu);
+	if (IS_ERR(thread))
+		return PTR_ERR(thread);
+
+	kthread_bind(thread, on_cpu);
+	wake_up_process(thread);
+
+	wait_for_completion(&run.done);
+	kthread_stop(thread);
+
+	return run.rc;
+}
+
+static const struct bench_op *find_op(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(bench_ops); i++)
+		if (sysfs_streq(name, bench_ops[i].name))
+			return &bench_ops[i];
+
+	return NULL;
+}
+
 static int __init hello_init(void)
 {
-	int rc = print_message(count);
-	if (!rc)
+	const struct bench_op *bop = find_op(op);
+	int rc;
+
+	if (!bop) {
+		printk(KERN_ERR "Unknown op: %s\n", op);
+		return -EINVAL;
+	}
+
+	if (count > COUNT_MAX || warmup > COUNT_MAX || repeat > REPEAT_MAX) {
+		printk(KERN_ERR "Max count/warmup: %u, max repeat: %u\n",
+		       COUNT_MAX, REPEAT_MAX);
+		return -EINVAL;
+	}
+
+	if (cpu >= 0 && (cpu >= nr_cpu_ids || !cpu_online(cpu))) {
+		printk(KERN_ERR "CPU %d is not online\n", cpu);
+		return -EINVAL;
+	}
+
+	if (cpu >= 0)
+		rc = run_pinned(bop, count, cpu);
+	else
+		rc = print_message(bop, count);
+
+	if (rc)
 		printk(KERN_ERR "Unable to print message, rc: %d\n", rc);
 
 	return rc;
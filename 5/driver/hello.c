@@ -33,6 +33,17 @@
 #include <linux/printk.h>
 #include <linux/ktime.h>
 #include <linux/slab.h>
+#include <linux/math64.h>
+#include <linux/log2.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/fs.h>
+#include <linux/miscdevice.h>
+#include <linux/version.h>
+#include <linux/spinlock.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/mutex.h>
 
 MODULE_AUTHOR("Kirill Yatsenko <kirill.yatsenko@globallogic.com>");
 MODULE_DESCRIPTION("HM #1");
@@ -41,29 +52,350 @@ MODULE_LICENSE("Dual BSD/GPL");
 static uint count=1;
 module_param(count,int,0660);
 
-LIST_HEAD(time_history);
+#define HISTORY_MAX	(1U << 24)
 
-struct time_entry {
-	ktime_t start;
-	ktime_t end;
-	struct list_head node;
+static uint history_size;
+module_param(history_size, uint, 0444);
+MODULE_PARM_DESC(history_size, "Samples kept, the oldest are overwritten (0 - count, max 16M)");
+
+/*
+ * Timing history is a fixed-capacity ring in struct-of-arrays layout.
+ * It is one vmalloc_user() area that /dev/hello maps read only: a header
+ * page followed by the page-aligned starts[] and ends[] arrays. Samples
+ * head - min(head, capacity) .. head - 1 are valid, sample i lives at
+ * index i & (capacity - 1).
+ */
+struct time_history_hdr {
+	__u64 capacity;
+	__u64 head;
+	__u64 starts_offset;
+	__u64 ends_offset;
+};
+
+static struct {
+	struct time_history_hdr *hdr;
+	ktime_t *starts;
+	ktime_t *ends;
+	u64 mask;
+	size_t size;
+} time_history;
+
+/*
+ * HDR-style latency histogram of the measured regions: values below
+ * 2 * HIST_HALF ns get exact buckets, above that every power of two is
+ * split into HIST_HALF buckets, i.e. about 3% relative precision with
+ * constant memory over the whole u64 range.
+ */
+#define HIST_SUB_BITS	5
+#define HIST_HALF	(1U << (HIST_SUB_BITS - 1))
+#define HIST_BUCKETS	(HIST_HALF * (64 - HIST_SUB_BITS + 2))
+
+static struct {
+	spinlock_t lock;
+	u64 count;
+	u64 sum;
+	u64 min;
+	u64 max;
+	u64 buckets[HIST_BUCKETS];
+} latency_hist = {
+	.lock	= __SPIN_LOCK_UNLOCKED(latency_hist.lock),
+	.min	= U64_MAX,
+};
+
+struct latency_summary {
+	u64 count;
+	u64 min;
+	u64 max;
+	u64 mean;
+	u64 p50;
+	u64 p99;
+	u64 p999;
+};
+
+static struct dentry *latency_dentry;
+
+/* Serializes measured runs, time_history_add() has a single writer */
+static DEFINE_MUTEX(measure_lock);
+
+static unsigned int hist_index(u64 value)
+{
+	unsigned int shift;
+
+	if (value < 2 * HIST_HALF)
+		return value;
+
+	shift = fls64(value) - HIST_SUB_BITS;
+	return HIST_HALF * shift + (unsigned int)(value >> shift);
+}
+
+/* Highest value that falls into bucket @idx */
+static u64 hist_bucket_top(unsigned int idx)
+{
+	unsigned int shift;
+
+	if (idx < 2 * HIST_HALF)
+		return idx;
+
+	shift = idx / HIST_HALF - 1;
+	return ((u64)(idx - HIST_HALF * shift + 1) << shift) - 1;
+}
+
+static void latency_hist_record(ktime_t duration)
+{
+	u64 value = duration > 0 ? duration : 0;
+
+	spin_lock(&latency_hist.lock);
+	latency_hist.count++;
+	latency_hist.sum += value;
+	latency_hist.min = min(latency_hist.min, value);
+	latency_hist.max = max(latency_hist.max, value);
+	latency_hist.buckets[hist_index(value)]++;
+	spin_unlock(&latency_hist.lock);
+}
+
+static void latency_hist_reset(void)
+{
+	spin_lock(&latency_hist.lock);
+	latency_hist.count = 0;
+	latency_hist.sum = 0;
+	latency_hist.min = U64_MAX;
+	latency_hist.max = 0;
+	memset(latency_hist.buckets, 0, sizeof(latency_hist.buckets));
+	spin_unlock(&latency_hist.lock);
+}
+
+/* Caller holds the lock; @permille of the samples are <= the result */
+static u64 hist_percentile(uint permille)
+{
+	u64 rank = div_u64(latency_hist.count * permille + 999, 1000);
+	u64 seen = 0;
+	unsigned int idx;
+
+	for (idx = 0; idx < HIST_BUCKETS; idx++) {
+		seen += latency_hist.buckets[idx];
+		if (seen && seen >= rank)
+			return min(hist_bucket_top(idx), latency_hist.max);
+	}
+
+	return latency_hist.max;
+}
+
+static void latency_hist_summary(struct latency_summary *sum)
+{
+	memset(sum, 0, sizeof(*sum));
+
+	spin_lock(&latency_hist.lock);
+	if (latency_hist.count) {
+		sum->count = latency_hist.count;
+		sum->min = latency_hist.min;
+		sum->max = latency_hist.max;
+		sum->mean = div64_u64(latency_hist.sum, latency_hist.count);
+		sum->p50 = hist_percentile(500);
+		sum->p99 = hist_percentile(990);
+		sum->p999 = hist_percentile(999);
+	}
+	spin_unlock(&latency_hist.lock);
+}
+
+static int latency_show(struct seq_file *s, void *unused)
+{
+	struct latency_summary sum;
+
+	latency_hist_summary(&sum);
+
+	seq_printf(s, "count: %llu\n", sum.count);
+	seq_printf(s, "min:   %llu ns\n", sum.min);
+	seq_printf(s, "max:   %llu ns\n", sum.max);
+	seq_printf(s, "mean:  %llu ns\n", sum.mean);
+	seq_printf(s, "p50:   %llu ns\n", sum.p50);
+	seq_printf(s, "p99:   %llu ns\n", sum.p99);
+	seq_printf(s, "p99.9: %llu ns\n", sum.p999);
+
+	return 0;
+}
+
+static int latency_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, latency_show, NULL);
+}
+
+/* Any write resets the histogram */
+static ssize_t latency_write(struct file *file, const char __user *buf,
+			     size_t count, loff_t *ppos)
+{
+	latency_hist_reset();
+	return count;
+}
+
+static const struct file_operations latency_fops = {
+	.owner		= THIS_MODULE,
+	.open		= latency_open,
+	.read		= seq_read,
+	.write		= latency_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static int history_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	vm_flags_clear(vma, VM_MAYWRITE);
+#else
+	vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+
+	return remap_vmalloc_range(vma, time_history.hdr, vma->vm_pgoff);
+}
+
+static const struct file_operations history_fops = {
+	.owner	= THIS_MODULE,
+	.mmap	= history_mmap,
+};
+
+static struct miscdevice history_dev = {
+	.minor	= MISC_DYNAMIC_MINOR,
+	.name	= KBUILD_MODNAME,
+	.fops	= &history_fops,
+	.mode	= 0444,
 };
 
+static int time_history_init(uint capacity)
+{
+	size_t array_size;
+	void *area;
+	int rc;
+
+	/* Keeps the power of two and the array sizes well inside a uint */
+	if (capacity > HISTORY_MAX) {
+		printk(KERN_ERR "Max history_size: %u\n", HISTORY_MAX);
+		return -EINVAL;
+	}
+
+	capacity = roundup_pow_of_two(max(capacity, 1U));
+	array_size = PAGE_ALIGN((size_t)capacity * sizeof(ktime_t));
+
+	time_history.size = PAGE_SIZE + 2 * array_size;
+	area = vmalloc_user(time_history.size);
+	if (!area)
+		return -ENOMEM;
+
+	time_history.hdr = area;
+	time_history.starts = area + PAGE_SIZE;
+	time_history.ends = area + PAGE_SIZE + array_size;
+	time_history.mask = capacity - 1;
+
+	time_history.hdr->capacity = capacity;
+	time_history.hdr->head = 0;
+	time_history.hdr->starts_offset = PAGE_SIZE;
+	time_history.hdr->ends_offset = PAGE_SIZE + array_size;
+
+	rc = misc_register(&history_dev);
+	if (rc) {
+		vfree(area);
+		time_history.hdr = NULL;
+		return rc;
+	}
+
+	return 0;
+}
+
 static void release_time_history(void)
 {
-	struct time_entry *entry = NULL;
-	struct time_entry *tmp = NULL;
+	if (!time_history.hdr)
+		return;
+
+	misc_deregister(&history_dev);
+	vfree(time_history.hdr);
+	time_history.hdr = NULL;
+}
+
+static void time_history_add(ktime_t start, ktime_t end)
+{
+	u64 head = time_history.hdr->head;
+	u64 idx = head & time_history.mask;
+
+	time_history.starts[idx] = start;
+	time_history.ends[idx] = end;
+	latency_hist_record(end - start);
+
+	/* Readers of the mapping check head after the sample is in place */
+	smp_wmb();
+	WRITE_ONCE(time_history.hdr->head, head + 1);
+}
+
+/* What a per-sample kzalloc() used to add to every measured region */
+static void measure_alloc_overhead(uint num)
+{
+	ktime_t total = 0;
+	ktime_t start;
+	void *sample;
+	uint i;
+
+	if (!num)
+		return;
 
-	list_for_each_entry_safe(entry, tmp, &time_history, node) {
-		kfree(entry);
-		list_del(&entry->node);
+	for (i = 0; i < num; i++) {
+		start = ktime_get();
+		sample = kzalloc(2 * sizeof(ktime_t), GFP_KERNEL);
+		total += ktime_get() - start;
+		kfree(sample);
 	}
+
+	pr_debug("kzalloc overhead removed from timed region: %lld ns total, %llu ns per entry\n",
+		 total, div_u64(total, num));
 }
 
+/* Time @num printk() calls into the history and the histogram */
+static void measure_regions(uint num)
+{
+	ktime_t start;
+	ktime_t end;
+
+	mutex_lock(&measure_lock);
+	measure_alloc_overhead(num);
+
+	while (num--) {
+		start = ktime_get();
+		printk(KERN_INFO "Hello World!\n");
+		end = ktime_get();
+
+		time_history_add(start, end);
+		cond_resched();
+	}
+	mutex_unlock(&measure_lock);
+}
+
+/* Writing N runs N more measured regions while the module is loaded */
+static ssize_t run_write(struct file *file, const char __user *buf,
+			 size_t count, loff_t *ppos)
+{
+	uint num;
+	int rc;
+
+	rc = kstrtouint_from_user(buf, count, 0, &num);
+	if (rc)
+		return rc;
+	if (!num || num > HISTORY_MAX)
+		return -EINVAL;
+
+	measure_regions(num);
+
+	return count;
+}
+
+static const struct file_operations run_fops = {
+	.owner	= THIS_MODULE,
+	.write	= run_write,
+	.llseek	= noop_llseek,
+};
+
 static int print_message(uint num)
 {
-	int rc = 0;
-	struct time_entry *entry = NULL;
+	ktime_t start;
+	ktime_t end;
 
 	if (!num || (num > 5 && num < 10)) {
 		printk(KERN_WARNING "Count is: %d\n", num);
@@ -71,54 +403,58 @@ static int print_message(uint num)
 
 	BUG_ON(num > 10);
 
+	mutex_lock(&measure_lock);
+	measure_alloc_overhead(num);
+
 	while (num--) {
 		BUG_ON(num == 5);
 
-		entry = kzalloc(sizeof(*entry), GFP_KERNEL);
-		if (!entry) {
-			rc = -ENOMEM;
-			goto error;
-		}
-
-		entry->start = ktime_get();
+		start = ktime_get();
 		printk(KERN_INFO "Hello World!\n");
-		entry->end = ktime_get();
+		end = ktime_get();
 
-		list_add_tail(&entry->node, &time_history);
+		time_history_add(start, end);
 	}
+	mutex_unlock(&measure_lock);
 
-	return rc;
-
-error:
-	release_time_history();
-	return rc;
+	return 0;
 }
 
 static int __init hello_init(void)
 {
-	int rc = print_message(count);
-	if (rc)
+	int rc = time_history_init(history_size ?: count);
+	if (rc) {
+		printk(KERN_ERR "Unable to allocate time history, rc: %d\n", rc);
+		return rc;
+	}
+
+	latency_dentry = debugfs_create_dir(KBUILD_MODNAME, NULL);
+	debugfs_create_file("latency", 0644, latency_dentry, NULL,
+			    &latency_fops);
+	debugfs_create_file("run", 0200, latency_dentry, NULL, &run_fops);
+
+	rc = print_message(count);
+	if (rc) {
 		printk(KERN_ERR "Unable to print message, rc: %d\n", rc);
+		debugfs_remove_recursive(latency_dentry);
+		release_time_history();
+	}
 
 	return rc;
 }
 
 static void __exit hello_exit(void)
 {
-	struct time_entry *entry = NULL;
-	struct time_entry *tmp = NULL;
+	struct latency_summary sum;
 
-	pr_debug("printing time history\n");
+	debugfs_remove_recursive(latency_dentry);
 
-	list_for_each_entry_safe(entry, tmp, &time_history, node) {
-		pr_debug("time: %lld print duration: %lld\n", entry->start,
-			 entry->end - entry->start);
+	latency_hist_summary(&sum);
+	pr_info("print latency: count %llu min %llu max %llu mean %llu p50 %llu p99 %llu p99.9 %llu ns\n",
+		sum.count, sum.min, sum.max, sum.mean, sum.p50, sum.p99,
+		sum.p999);
 
-		kfree(entry);
-		list_del(&entry->node);
-	}
-
-	pr_debug("done printing time history\n");
+	release_time_history();
 }
 
 module_init(hello_init);
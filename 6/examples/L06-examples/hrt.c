@@ -2,6 +2,13 @@
 #include <linux/module.h>
 #include <linux/hrtimer.h>
 #include <linux/ktime.h>
+#include <linux/vmalloc.h>
+#include <linux/random.h>
+#include <linux/atomic.h>
+#include <linux/math64.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
 
 MODULE_LICENSE("GPL");
 
@@ -12,6 +19,39 @@ static struct hrtimer hr_timer;
 static int restart = 5;
 static unsigned long delay_in_ms = 200L;
 
+#define NR_TIMERS_MAX	(1U << 20)
+
+static unsigned int nr_timers;
+module_param(nr_timers, uint, 0444);
+MODULE_PARM_DESC(nr_timers, "hrtimer benchmark with this many timers (0: single timer demo)");
+
+static unsigned int spread_ms = 1000;
+module_param(spread_ms, uint, 0444);
+MODULE_PARM_DESC(spread_ms, "Expiries are spread over this many ms");
+
+static unsigned int clusters;
+module_param(clusters, uint, 0444);
+MODULE_PARM_DESC(clusters, "Group expiries around this many points (0: uniform random)");
+
+static unsigned int slack_us;
+module_param(slack_us, uint, 0444);
+MODULE_PARM_DESC(slack_us, "Expiry slack passed to hrtimer_start_range_ns()");
+
+static unsigned int mux_timeouts;
+module_param(mux_timeouts, uint, 0444);
+MODULE_PARM_DESC(mux_timeouts, "Multiplex this many timeouts onto one hrtimer per CPU");
+
+static unsigned int mux_cancel_pct = 25;
+module_param(mux_cancel_pct, uint, 0444);
+MODULE_PARM_DESC(mux_cancel_pct, "Percentage of multiplexed timeouts cancelled before expiry");
+
+static struct hrtimer *bench;
+static u64 spread_ns;
+static bool bench_live;
+static atomic_t bench_pending;
+static atomic64_t late_sum;
+static atomic64_t late_max;
+
 enum hrtimer_restart my_hrtimer_callback( struct hrtimer *timer)
 {
 	pr_info("my_hrtimer_callback called (%llu).\n",
@@ -25,10 +65,536 @@ enum hrtimer_restart my_hrtimer_callback( struct hrtimer *timer)
 	return HRTIMER_NORESTART;
 }
 
+/* Offset in ns of timer i from the start of a phase, at least 1 us */
+static u64 bench_offset(unsigned int i)
+{
+	u64 center;
+
+	if (!clusters)
+		return NSEC_PER_USEC + (((u64)get_random_u32() * spread_ns) >> 32);
+
+	center = div_u64((u64)(i % clusters) * spread_ns, clusters);
+	return NSEC_PER_USEC + center + get_random_u32() % NSEC_PER_USEC;
+}
+
+static enum hrtimer_restart bench_callback(struct hrtimer *timer)
+{
+	s64 late = ktime_to_ns(ktime_sub(ktime_get(), hrtimer_get_expires(timer)));
+	s64 max = atomic64_read(&late_max);
+
+	/* Timers that expire during the cost phases are not measured */
+	if (!READ_ONCE(bench_live))
+		return HRTIMER_NORESTART;
+
+	while (late > max) {
+		s64 old = atomic64_cmpxchg(&late_max, max, late);
+
+		if (old == max)
+			break;
+		max = old;
+	}
+	atomic64_add(late, &late_sum);
+
+	if (atomic_dec_and_test(&bench_pending))
+		pr_info("all %u hrtimers fired: lateness mean %lld max %lld ns\n",
+			nr_timers, div_s64(atomic64_read(&late_sum), nr_timers),
+			(s64)atomic64_read(&late_max));
+
+	return HRTIMER_NORESTART;
+}
+
+static void bench_report(const char *what, u64 ns, unsigned int nr)
+{
+	pr_info("%-12s %12llu ns total, %6llu ns/timer\n", what, ns,
+		div_u64(ns, nr));
+}
+
+static void bench_arm(unsigned int i, ktime_t due)
+{
+	hrtimer_start_range_ns(&bench[i], due, (u64)slack_us * NSEC_PER_USEC,
+			       HRTIMER_MODE_ABS);
+}
+
+/*
+ * Same load as the timer.c benchmark, on hrtimers: arm, push later,
+ * cancel, then arm for real and report lateness from the last callback.
+ * There is no timer_reduce() counterpart, so that phase is absent.
+ */
+static int bench_run(void)
+{
+	ktime_t now;
+	unsigned int i;
+	u64 t0;
+
+	if (nr_timers > NR_TIMERS_MAX)
+		return -EINVAL;
+
+	bench = vzalloc(array_size(nr_timers, sizeof(*bench)));
+	if (!bench)
+		return -ENOMEM;
+
+	spread_ns = (u64)spread_ms * NSEC_PER_MSEC;
+	for (i = 0; i < nr_timers; i++) {
+		hrtimer_init(&bench[i], CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+		bench[i].function = &bench_callback;
+	}
+
+	now = ktime_get();
+	t0 = ktime_get_ns();
+	for (i = 0; i < nr_timers; i++)
+		bench_arm(i, ktime_add_ns(now, bench_offset(i)));
+	bench_report("arm", ktime_get_ns() - t0, nr_timers);
+
+	t0 = ktime_get_ns();
+	for (i = 0; i < nr_timers; i++)
+		bench_arm(i, ktime_add_ns(hrtimer_get_expires(&bench[i]),
+					  spread_ns));
+	bench_report("rearm", ktime_get_ns() - t0, nr_timers);
+
+	t0 = ktime_get_ns();
+	for (i = 0; i < nr_timers; i++)
+		hrtimer_try_to_cancel(&bench[i]);
+	bench_report("cancel", ktime_get_ns() - t0, nr_timers);
+
+	/* Wait out callbacks of timers that fired early, before going live */
+	for (i = 0; i < nr_timers; i++)
+		hrtimer_cancel(&bench[i]);
+
+	atomic_set(&bench_pending, nr_timers);
+	WRITE_ONCE(bench_live, true);
+	now = ktime_get();
+	for (i = 0; i < nr_timers; i++)
+		bench_arm(i, ktime_add_ns(now, bench_offset(i)));
+	pr_info("%u hrtimers armed over %u ms (%s, slack %u us)\n", nr_timers,
+		spread_ms, clusters ? "clustered" : "uniform", slack_us);
+
+	return 0;
+}
+
+/*
+ * Many logical timeouts per CPU share one pinned hrtimer. Pending
+ * timeouts sit in a min-heap by deadline and the hrtimer is only
+ * reprogrammed when the earliest deadline moves. Every timeout knows its
+ * heap slot, so cancel and re-arm are O(log n) removals. The heap of a
+ * CPU is allocated on the first mux_add() there and doubles when full.
+ * Add and cancel of one timeout must be serialized by the caller, and
+ * it must stay allocated while pending or while its expire callback may
+ * run: free it only after mux_cancel_sync(). Set index to MUX_IDLE
+ * before first use.
+ */
+#define MUX_IDLE	UINT_MAX
+#define MUX_MIN_CAP	64
+
+struct mux_cpu;
+
+struct mux_timeout {
+	u64 deadline;
+	struct mux_cpu *mc;
+	unsigned int index;
+};
+
+#define MUX_BATCH	64
+
+typedef void (*mux_expire_fn)(struct mux_timeout **batch, unsigned int nr);
+
+struct mux_cpu {
+	raw_spinlock_t lock;
+	struct hrtimer timer;
+	struct mux_timeout **heap;
+	unsigned int nr;
+	unsigned int cap;
+	u64 programmed;
+	bool running;
+	mux_expire_fn expire;
+	struct mux_timeout *batch[MUX_BATCH];
+
+	unsigned long added;
+	unsigned long expired;
+	unsigned long cancelled;
+	unsigned long batches;
+	unsigned long reprograms;
+};
+
+static DEFINE_PER_CPU(struct mux_cpu, mux_cpu);
+static struct mux_timeout *mux_bench;
+static atomic_t mux_fired;
+
+static void mux_set(struct mux_cpu *mc, unsigned int i, struct mux_timeout *t)
+{
+	mc->heap[i] = t;
+	t->index = i;
+}
+
+static void mux_sift_up(struct mux_cpu *mc, unsigned int i)
+{
+	struct mux_timeout *t = mc->heap[i];
+
+	while (i) {
+		unsigned int parent = (i - 1) / 2;
+
+		if (mc->heap[parent]->deadline <= t->deadline)
+			break;
+		mux_set(mc, i, mc->heap[parent]);
+		i = parent;
+	}
+	mux_set(mc, i, t);
+}
+
+static void mux_sift_down(struct mux_cpu *mc, unsigned int i)
+{
+	struct mux_timeout *t = mc->heap[i];
+
+	while (2 * i + 1 < mc->nr) {
+		unsigned int child = 2 * i + 1;
+
+		if (child + 1 < mc->nr &&
+		    mc->heap[child + 1]->deadline < mc->heap[child]->deadline)
+			child++;
+		if (t->deadline <= mc->heap[child]->deadline)
+			break;
+		mux_set(mc, i, mc->heap[child]);
+		i = child;
+	}
+	mux_set(mc, i, t);
+}
+
+/* Take the timeout in slot @i out of the heap, called with mc->lock held */
+static void mux_remove(struct mux_cpu *mc, unsigned int i)
+{
+	struct mux_timeout *t = mc->heap[i];
+	struct mux_timeout *last = mc->heap[--mc->nr];
+
+	t->index = MUX_IDLE;
+	if (i == mc->nr)
+		return;
+
+	mux_set(mc, i, last);
+	if (i && mc->heap[(i - 1) / 2]->deadline > last->deadline)
+		mux_sift_up(mc, i);
+	else
+		mux_sift_down(mc, i);
+}
+
+/* Called with mc->lock held */
+static void mux_program(struct mux_cpu *mc)
+{
+	u64 first = mc->heap[0]->deadline;
+
+	if (mc->running || first >= mc->programmed)
+		return;
+
+	mc->programmed = first;
+	mc->reprograms++;
+	hrtimer_start(&mc->timer, ns_to_ktime(first), HRTIMER_MODE_ABS_PINNED);
+}
+
+/*
+ * Dequeue @t if it is pending, O(log n). Returns true if it was. An
+ * hrtimer programmed for it is left alone and just finds nothing due.
+ */
+static bool mux_cancel(struct mux_timeout *t)
+{
+	struct mux_cpu *mc = READ_ONCE(t->mc);
+	unsigned long flags;
+	bool pending = false;
+
+	if (!mc)
+		return false;
+
+	raw_spin_lock_irqsave(&mc->lock, flags);
+	if (t->index != MUX_IDLE) {
+		mux_remove(mc, t->index);
+		mc->cancelled++;
+		pending = true;
+	}
+	raw_spin_unlock_irqrestore(&mc->lock, flags);
+
+	return pending;
+}
+
+/*
+ * Like mux_cancel(), and also waits for an expire callback that may
+ * still hold @t to return, as hrtimer_cancel() does. @t can be freed
+ * afterwards. Must not be called from the expire callback.
+ */
+static bool mux_cancel_sync(struct mux_timeout *t)
+{
+	struct mux_cpu *mc = READ_ONCE(t->mc);
+	unsigned long flags;
+	bool pending;
+	bool running;
+
+	pending = mux_cancel(t);
+	if (!mc)
+		return pending;
+
+	for (;;) {
+		raw_spin_lock_irqsave(&mc->lock, flags);
+		running = mc->running;
+		raw_spin_unlock_irqrestore(&mc->lock, flags);
+		if (!running)
+			break;
+		cpu_relax();
+	}
+
+	return pending;
+}
+
+/*
+ * Queue @t on the current CPU, O(log n). A pending @t is moved to the
+ * new deadline, like mod_timer(). @gfp is used when the heap has to grow.
+ */
+static int mux_add(struct mux_timeout *t, u64 deadline, gfp_t gfp)
+{
+	struct mux_timeout **heap = NULL;
+	struct mux_timeout **old;
+	unsigned int cap = 0;
+	struct mux_cpu *mc;
+	unsigned long flags;
+
+	mux_cancel(t);
+
+	for (;;) {
+		local_irq_save(flags);
+		mc = this_cpu_ptr(&mux_cpu);
+		raw_spin_lock(&mc->lock);
+
+		if (mc->nr < mc->cap)
+			break;
+
+		/* Grown on an earlier pass, unless we migrated since */
+		if (heap && cap > mc->cap) {
+			if (mc->nr)
+				memcpy(heap, mc->heap, mc->nr * sizeof(*heap));
+			old = mc->heap;
+			mc->heap = heap;
+			mc->cap = cap;
+			heap = old;
+			break;
+		}
+
+		cap = mc->cap ? 2 * mc->cap : MUX_MIN_CAP;
+		raw_spin_unlock(&mc->lock);
+		local_irq_restore(flags);
+
+		kvfree(heap);
+		heap = kvmalloc_array(cap, sizeof(*heap), gfp);
+		if (!heap)
+			return -ENOMEM;
+	}
+
+	t->deadline = deadline;
+	WRITE_ONCE(t->mc, mc);
+	mux_set(mc, mc->nr++, t);
+	mux_sift_up(mc, mc->nr - 1);
+	mc->added++;
+	mux_program(mc);
+
+	raw_spin_unlock(&mc->lock);
+	local_irq_restore(flags);
+
+	/* Left over from a migration or replaced by a larger one */
+	kvfree(heap);
+
+	return 0;
+}
+
+static enum hrtimer_restart mux_timer_fn(struct hrtimer *timer)
+{
+	struct mux_cpu *mc = container_of(timer, struct mux_cpu, timer);
+	enum hrtimer_restart ret = HRTIMER_NORESTART;
+	unsigned int nr;
+	u64 now;
+
+	raw_spin_lock(&mc->lock);
+	mc->running = true;
+
+	do {
+		now = ktime_get_ns();
+		nr = 0;
+		while (mc->nr && mc->heap[0]->deadline <= now && nr < MUX_BATCH) {
+			mc->batch[nr++] = mc->heap[0];
+			mux_remove(mc, 0);
+		}
+		if (!nr)
+			break;
+
+		mc->expired += nr;
+		mc->batches++;
+
+		/* The callback may queue new timeouts on this CPU */
+		raw_spin_unlock(&mc->lock);
+		mc->expire(mc->batch, nr);
+		raw_spin_lock(&mc->lock);
+	} while (nr == MUX_BATCH);
+
+	mc->running = false;
+	mc->programmed = U64_MAX;
+	if (mc->nr) {
+		mc->programmed = mc->heap[0]->deadline;
+		mc->reprograms++;
+		hrtimer_set_expires(timer, ns_to_ktime(mc->programmed));
+		ret = HRTIMER_RESTART;
+	}
+	raw_spin_unlock(&mc->lock);
+
+	return ret;
+}
+
+static void mux_destroy(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct mux_cpu *mc = per_cpu_ptr(&mux_cpu, cpu);
+
+		hrtimer_cancel(&mc->timer);
+		kvfree(mc->heap);
+		mc->heap = NULL;
+		mc->nr = 0;
+		mc->cap = 0;
+	}
+}
+
+/* No memory yet, each CPU's heap is allocated by its first mux_add() */
+static void mux_init(mux_expire_fn expire)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct mux_cpu *mc = per_cpu_ptr(&mux_cpu, cpu);
+
+		raw_spin_lock_init(&mc->lock);
+		hrtimer_init(&mc->timer, CLOCK_MONOTONIC,
+			     HRTIMER_MODE_ABS_PINNED);
+		mc->timer.function = &mux_timer_fn;
+		mc->programmed = U64_MAX;
+		mc->expire = expire;
+	}
+}
+
+static void mux_report(void)
+{
+	unsigned long added = 0, expired = 0, cancelled = 0;
+	unsigned long batches = 0, reprograms = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct mux_cpu *mc = per_cpu_ptr(&mux_cpu, cpu);
+
+		added += mc->added;
+		expired += mc->expired;
+		cancelled += mc->cancelled;
+		batches += mc->batches;
+		reprograms += mc->reprograms;
+	}
+
+	pr_info("mux: added %lu expired %lu cancelled %lu, %lu batches, %lu hrtimer reprograms\n",
+		added, expired, cancelled, batches, reprograms);
+}
+
+static void mux_bench_expire(struct mux_timeout **batch, unsigned int nr)
+{
+	u64 now = ktime_get_ns();
+	s64 max = atomic64_read(&late_max);
+	s64 sum = 0;
+	unsigned int i;
+
+	for (i = 0; i < nr; i++) {
+		s64 late = now - batch[i]->deadline;
+
+		sum += late;
+		while (late > max) {
+			s64 old = atomic64_cmpxchg(&late_max, max, late);
+
+			if (old == max)
+				break;
+			max = old;
+		}
+	}
+	atomic64_add(sum, &late_sum);
+	atomic_add(nr, &mux_fired);
+}
+
+/*
+ * Arm mux_timeouts timeouts from this CPU, cancel mux_cancel_pct of them
+ * and let the rest expire. Results are reported on unload.
+ */
+static int mux_bench_run(void)
+{
+	u64 now;
+	unsigned int i;
+	u64 t0;
+	int ret;
+
+	if (mux_timeouts > NR_TIMERS_MAX)
+		return -EINVAL;
+
+	mux_bench = vzalloc(array_size(mux_timeouts, sizeof(*mux_bench)));
+	if (!mux_bench)
+		return -ENOMEM;
+
+	for (i = 0; i < mux_timeouts; i++)
+		mux_bench[i].index = MUX_IDLE;
+	mux_init(mux_bench_expire);
+
+	spread_ns = (u64)spread_ms * NSEC_PER_MSEC;
+
+	now = ktime_get_ns();
+	t0 = ktime_get_ns();
+	for (i = 0; i < mux_timeouts; i++) {
+		ret = mux_add(&mux_bench[i], now + bench_offset(i), GFP_KERNEL);
+		if (ret) {
+			mux_destroy();
+			vfree(mux_bench);
+			return ret;
+		}
+	}
+	bench_report("mux arm", ktime_get_ns() - t0, mux_timeouts);
+
+	t0 = ktime_get_ns();
+	for (i = 0; i < mux_timeouts; i++)
+		if (i % 100 < mux_cancel_pct)
+			mux_cancel(&mux_bench[i]);
+	bench_report("mux cancel", ktime_get_ns() - t0, mux_timeouts);
+
+	pr_info("%u timeouts multiplexed over %u ms (%s)\n", mux_timeouts,
+		spread_ms, clusters ? "clustered" : "uniform");
+
+	return 0;
+}
+
+static void mux_bench_exit(void)
+{
+	unsigned int i;
+	int fired;
+
+	mux_report();
+
+	/* Teardown cancels are not counted in the report above */
+	for (i = 0; i < mux_timeouts; i++)
+		mux_cancel_sync(&mux_bench[i]);
+	mux_destroy();
+
+	fired = atomic_read(&mux_fired);
+	if (fired)
+		pr_info("mux: lateness mean %lld max %lld ns\n",
+			div_s64(atomic64_read(&late_sum), fired),
+			(s64)atomic64_read(&late_max));
+
+	vfree(mux_bench);
+}
+
 static __init int hrt_init(void)
 {
 	ktime_t ktime;
 
+	if (mux_timeouts)
+		return mux_bench_run();
+
+	if (nr_timers)
+		return bench_run();
+
 	pr_info("HR Timer module installing\n");
 
 	ktime = ktime_set(0, MS_TO_NS(delay_in_ms));
@@ -45,8 +611,21 @@ static __init int hrt_init(void)
 
 static __exit void hrt_exit(void)
 {
+	unsigned int i;
 	int ret;
 
+	if (mux_timeouts) {
+		mux_bench_exit();
+		return;
+	}
+
+	if (nr_timers) {
+		for (i = 0; i < nr_timers; i++)
+			hrtimer_cancel(&bench[i]);
+		vfree(bench);
+		return;
+	}
+
 	ret = hrtimer_cancel(&hr_timer);
 	if (ret)
 		pr_info("The timer was still in use...\n");
@@ -2,58 +2,280 @@
 #include <linux/module.h>
 #include <linux/workqueue.h>
 #include <linux/slab.h>
+#include <linux/ktime.h>
+#include <linux/cpumask.h>
+#include <linux/cpu.h>
+#include <linux/atomic.h>
+#include <linux/completion.h>
+#include <linux/math64.h>
+#include <linux/llist.h>
+#include <linux/wait.h>
 
 MODULE_LICENSE("GPL");
 
+static unsigned int nr_items = 2;
+module_param(nr_items, uint, 0444);
+MODULE_PARM_DESC(nr_items, "Number of work items to queue");
+
+static char *cpus = "";
+module_param(cpus, charp, 0444);
+MODULE_PARM_DESC(cpus, "CPU list to queue on round-robin (empty: queue_work)");
+
+static bool unbound;
+module_param(unbound, bool, 0444);
+MODULE_PARM_DESC(unbound, "Allocate the workqueue with WQ_UNBOUND");
+
+static bool cpu_intensive;
+module_param(cpu_intensive, bool, 0444);
+MODULE_PARM_DESC(cpu_intensive, "Allocate the workqueue with WQ_CPU_INTENSIVE");
+
+static bool highpri;
+module_param(highpri, bool, 0444);
+MODULE_PARM_DESC(highpri, "Allocate the workqueue with WQ_HIGHPRI");
+
+static int max_active;
+module_param(max_active, int, 0444);
+MODULE_PARM_DESC(max_active, "max_active for alloc_workqueue (0: default)");
+
+static unsigned int pool_size = 1024;
+module_param(pool_size, uint, 0444);
+MODULE_PARM_DESC(pool_size, "Preallocated work items; queueing waits when all are in flight");
+
 static struct workqueue_struct *my_wq;
 
 typedef struct {
 	struct work_struct my_work;
+	struct llist_node free_node;
 	int    x;
+	u64    queued_ns;
 } my_work_t;
 
-my_work_t *work, *work2;
+/*
+ * Work items are allocated and initialized once. Finished items are
+ * pushed back by the work function; only queue_items() pops, so the
+ * freelist has a single consumer as llist_del_first() requires.
+ */
+static my_work_t *pool;
+static LLIST_HEAD(pool_free);
+static DECLARE_WAIT_QUEUE_HEAD(pool_wait);
+
+/* Results of one run, updated from the work function */
+static struct {
+	atomic_t remaining;
+	atomic64_t lat_sum;
+	atomic64_t lat_max;
+	unsigned long hits;
+	unsigned long misses;
+	u64 last_ns;
+	struct completion done;
+} run;
 
 static void my_wq_function(struct work_struct *work)
 {
 	my_work_t *my_work = (my_work_t *)work;
-	printk("my_work.x %d\n", my_work->x);
-	kfree((void *)work);
+	u64 now = ktime_get_ns();
+	u64 lat = now - my_work->queued_ns;
+	u64 max = atomic64_read(&run.lat_max);
+
+	while (lat > max) {
+		u64 old = atomic64_cmpxchg(&run.lat_max, max, lat);
+
+		if (old == max)
+			break;
+		max = old;
+	}
+	atomic64_add(lat, &run.lat_sum);
+
+	pr_debug("my_work.x %d\n", my_work->x);
+
+	llist_add(&my_work->free_node, &pool_free);
+	if (wq_has_sleeper(&pool_wait))
+		wake_up(&pool_wait);
+
+	if (atomic_dec_and_test(&run.remaining)) {
+		run.last_ns = now;
+		complete(&run.done);
+	}
 
 	return;
 }
 
+static void print_flags(char *buf, size_t len)
+{
+	snprintf(buf, len, "%s%s%s", unbound ? "unbound " : "",
+		 cpu_intensive ? "cpu_intensive " : "",
+		 highpri ? "highpri " : "");
+	if (!buf[0])
+		snprintf(buf, len, "none ");
+}
+
+static void print_report(const struct cpumask *mask, u64 start_ns)
+{
+	unsigned int done = nr_items;
+	u64 elapsed = run.last_ns - start_ns;
+	char flags[48];
+
+	print_flags(flags, sizeof(flags));
+
+	printk(KERN_INFO "simple_wq: flags %smax_active %d cpus %*pbl\n",
+	       flags, max_active, cpumask_pr_args(mask));
+	if (!done || !elapsed) {
+		printk(KERN_INFO "simple_wq: no items completed\n");
+		return;
+	}
+
+	printk(KERN_INFO "simple_wq: %u items in %llu ns, %llu items/s\n",
+	       done, elapsed, div64_u64((u64)done * NSEC_PER_SEC, elapsed));
+	printk(KERN_INFO "simple_wq: queueing latency mean %llu ns, max %llu ns\n",
+	       div_u64(atomic64_read(&run.lat_sum), done),
+	       (u64)atomic64_read(&run.lat_max));
+	printk(KERN_INFO "simple_wq: pool %u, freelist hits %lu, misses %lu\n",
+	       pool_size, run.hits, run.misses);
+}
+
+/* Take a free item, waiting for one to complete if the pool is drained */
+static my_work_t *pool_get(void)
+{
+	struct llist_node *node;
+
+	node = llist_del_first(&pool_free);
+	if (node) {
+		run.hits++;
+		return llist_entry(node, my_work_t, free_node);
+	}
+
+	run.misses++;
+	wait_event(pool_wait, (node = llist_del_first(&pool_free)) != NULL);
+
+	return llist_entry(node, my_work_t, free_node);
+}
+
+static int pool_init(void)
+{
+	unsigned int i;
+
+	if (!pool_size)
+		return -EINVAL;
+
+	pool = kcalloc(pool_size, sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return -ENOMEM;
+
+	for (i = 0; i < pool_size; i++) {
+		INIT_WORK((struct work_struct *)&pool[i], my_wq_function);
+		llist_add(&pool[i].free_node, &pool_free);
+	}
+
+	return 0;
+}
+
+static int queue_items(const struct cpumask *mask)
+{
+	my_work_t *work;
+	unsigned int i;
+	u64 start_ns;
+	int cpu = nr_cpu_ids;
+
+	init_completion(&run.done);
+	/* Bias keeps the count from hitting zero while still queueing */
+	atomic_set(&run.remaining, 1);
+
+	start_ns = ktime_get_ns();
+
+	for (i = 0; i < nr_items; i++) {
+		/* May sleep until an item completes, so outside cpus_read_lock() */
+		work = pool_get();
+		work->x = i + 1;
+		atomic_inc(&run.remaining);
+
+		if (cpumask_empty(mask)) {
+			work->queued_ns = ktime_get_ns();
+			queue_work(my_wq, (struct work_struct *)work);
+			continue;
+		}
+
+		cpu = cpumask_next(cpu, mask);
+		if (cpu >= nr_cpu_ids)
+			cpu = cpumask_first(mask);
+
+		cpus_read_lock();
+		work->queued_ns = ktime_get_ns();
+		queue_work_on(cpu, my_wq, (struct work_struct *)work);
+		cpus_read_unlock();
+	}
+
+	if (atomic_dec_and_test(&run.remaining)) {
+		run.last_ns = ktime_get_ns();
+		complete(&run.done);
+	}
+
+	wait_for_completion(&run.done);
+	print_report(mask, start_ns);
+
+	return 0;
+}
+
 static __init int simple_wq_init(void)
 {
+	unsigned int flags = 0;
+	cpumask_var_t mask;
 	int ret;
 
-	my_wq = create_workqueue("my_queue");
-	if (my_wq) {
+	if (!zalloc_cpumask_var(&mask, GFP_KERNEL))
+		return -ENOMEM;
 
-		/* Queue some work (item 1) */
-		work = (my_work_t *)kmalloc(sizeof(my_work_t), GFP_KERNEL);
-		if (work) {
-			INIT_WORK((struct work_struct *)work, my_wq_function);
-			work->x = 1;
-			ret = queue_work(my_wq, (struct work_struct *)work);
+	if (cpus[0]) {
+		ret = cpulist_parse(cpus, mask);
+		if (ret) {
+			printk(KERN_ERR "Bad cpu list: %s\n", cpus);
+			goto out;
 		}
-
-		/* Queue some additional work (item 2) */
-		work2 = (my_work_t *)kmalloc(sizeof(my_work_t), GFP_KERNEL);
-		if (work2) {
-			INIT_WORK((struct work_struct *)work2, my_wq_function);
-			work2->x = 2;
-			ret = queue_work(my_wq, (struct work_struct *)work2);
+		cpumask_and(mask, mask, cpu_online_mask);
+		if (cpumask_empty(mask)) {
+			printk(KERN_ERR "No online cpu in %s\n", cpus);
+			ret = -EINVAL;
+			goto out;
 		}
 	}
 
+	if (unbound)
+		flags |= WQ_UNBOUND;
+	if (cpu_intensive)
+		flags |= WQ_CPU_INTENSIVE;
+	if (highpri)
+		flags |= WQ_HIGHPRI;
+
+	ret = pool_init();
+	if (ret)
+		goto out;
+
+	my_wq = alloc_workqueue("my_queue", flags, max_active);
+	if (!my_wq) {
+		ret = -ENOMEM;
+		goto err_pool;
+	}
+
+	ret = queue_items(mask);
+	if (ret)
+		goto err_wq;
+
+	free_cpumask_var(mask);
 	return 0;
+
+err_wq:
+	destroy_workqueue(my_wq);
+err_pool:
+	kfree(pool);
+out:
+	free_cpumask_var(mask);
+	return ret;
 }
 
 static __exit void simple_wq_exit(void)
 {
 	flush_workqueue(my_wq);
 	destroy_workqueue(my_wq);
+	kfree(pool);
 
 	return;
 }
@@ -2,6 +2,10 @@
 #include <linux/module.h>
 #include <linux/ktime.h>
 #include <linux/timer.h>
+#include <linux/vmalloc.h>
+#include <linux/random.h>
+#include <linux/atomic.h>
+#include <linux/math64.h>
 
 MODULE_LICENSE("GPL");
 
@@ -11,6 +15,32 @@ static unsigned long start;
 static int restart = 5;
 static unsigned long delay_in_jiffies = (HZ * 200L) / MSEC_PER_SEC;
 
+#define NR_TIMERS_MAX	(1U << 20)
+
+static unsigned int nr_timers;
+module_param(nr_timers, uint, 0444);
+MODULE_PARM_DESC(nr_timers, "Timer wheel benchmark with this many timers (0: single timer demo)");
+
+static unsigned int spread_ms = 1000;
+module_param(spread_ms, uint, 0444);
+MODULE_PARM_DESC(spread_ms, "Expiries are spread over this many ms");
+
+static unsigned int clusters;
+module_param(clusters, uint, 0444);
+MODULE_PARM_DESC(clusters, "Group expiries around this many points (0: uniform random)");
+
+struct bench_timer {
+	struct timer_list timer;
+	unsigned long due;
+};
+
+static struct bench_timer *bench;
+static unsigned long spread;
+static bool bench_live;
+static atomic_t bench_pending;
+static atomic_long_t late_sum;
+static atomic_long_t late_max;
+
 static void timer_callback(struct timer_list *timer)
 {
 	pr_info("timer_callback called (%lu).\n", jiffies);
@@ -21,10 +51,120 @@ static void timer_callback(struct timer_list *timer)
 	}
 }
 
+/* Offset in jiffies of timer i from the start of a phase, at least 1 */
+static unsigned long bench_offset(unsigned int i)
+{
+	unsigned long center;
+
+	if (!clusters)
+		return 1 + get_random_u32() % spread;
+
+	center = div_u64((u64)(i % clusters) * spread, clusters);
+	return 1 + center + (get_random_u32() & 1);
+}
+
+static void bench_callback(struct timer_list *timer)
+{
+	struct bench_timer *bt = from_timer(bt, timer, timer);
+	long late = (long)(jiffies - bt->due);
+	long max = atomic_long_read(&late_max);
+
+	/* Timers that expire during the cost phases are not measured */
+	if (!READ_ONCE(bench_live))
+		return;
+
+	while (late > max) {
+		long old = atomic_long_cmpxchg(&late_max, max, late);
+
+		if (old == max)
+			break;
+		max = old;
+	}
+	atomic_long_add(late, &late_sum);
+
+	if (atomic_dec_and_test(&bench_pending))
+		pr_info("all %u timers fired: lateness mean %lu max %ld jiffies\n",
+			nr_timers, atomic_long_read(&late_sum) / nr_timers,
+			atomic_long_read(&late_max));
+}
+
+static void bench_report(const char *what, u64 ns)
+{
+	pr_info("%-12s %12llu ns total, %6llu ns/timer\n", what, ns,
+		div_u64(ns, nr_timers));
+}
+
+/*
+ * Measure wheel operations on nr_timers pending timers: arming, pushing
+ * them later with mod_timer(), pulling them back with timer_reduce() and
+ * cancelling. Finally arm them for real; lateness is reported from the
+ * callback of the last one to fire.
+ */
+static int bench_run(void)
+{
+	unsigned long now;
+	unsigned int i;
+	u64 t0;
+
+	if (nr_timers > NR_TIMERS_MAX)
+		return -EINVAL;
+
+	bench = vzalloc(array_size(nr_timers, sizeof(*bench)));
+	if (!bench)
+		return -ENOMEM;
+
+	spread = max(msecs_to_jiffies(spread_ms), 1UL);
+	for (i = 0; i < nr_timers; i++)
+		timer_setup(&bench[i].timer, bench_callback, 0);
+
+	now = jiffies;
+	for (i = 0; i < nr_timers; i++)
+		bench[i].due = now + bench_offset(i);
+
+	t0 = ktime_get_ns();
+	for (i = 0; i < nr_timers; i++)
+		mod_timer(&bench[i].timer, bench[i].due);
+	bench_report("arm", ktime_get_ns() - t0);
+
+	t0 = ktime_get_ns();
+	for (i = 0; i < nr_timers; i++)
+		mod_timer(&bench[i].timer, bench[i].due + spread);
+	bench_report("rearm", ktime_get_ns() - t0);
+
+	t0 = ktime_get_ns();
+	for (i = 0; i < nr_timers; i++)
+		timer_reduce(&bench[i].timer, bench[i].due);
+	bench_report("timer_reduce", ktime_get_ns() - t0);
+
+	t0 = ktime_get_ns();
+	for (i = 0; i < nr_timers; i++)
+		del_timer(&bench[i].timer);
+	bench_report("cancel", ktime_get_ns() - t0);
+
+	/* Wait out callbacks of timers that fired early, before going live */
+	for (i = 0; i < nr_timers; i++)
+		del_timer_sync(&bench[i].timer);
+
+	atomic_set(&bench_pending, nr_timers);
+	WRITE_ONCE(bench_live, true);
+	now = jiffies;
+	for (i = 0; i < nr_timers; i++) {
+		bench[i].due = now + bench_offset(i);
+		mod_timer(&bench[i].timer, bench[i].due);
+	}
+	pr_info("%u timers armed over %u ms (%s)\n", nr_timers, spread_ms,
+		clusters ? "clustered" : "uniform");
+
+	return 0;
+}
+
 static __init int timer_init(void)
 {
 	unsigned long now;
 
+	if (nr_timers)
+		return bench_run();
+
 	pr_info("Timer module installing\n");
 
 	timer_setup(&my_timer, timer_callback, 0);
@@ -41,6 +181,15 @@ static __init int timer_init(void)
 
 static __exit void timer_exit(void)
 {
+	unsigned int i;
+
+	if (nr_timers) {
+		for (i = 0; i < nr_timers; i++)
+			del_timer_sync(&bench[i].timer);
+		vfree(bench);
+		return;
+	}
+
 	if (del_timer(&my_timer))
 		pr_info("Рendng timer deleted\n");
 
@@ -11,6 +11,13 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/gpio.h>
+#include <linux/interrupt.h>
+#include <linux/workqueue.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/string.h>
+#include <linux/math64.h>
+#include <linux/atomic.h>
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Oleksandr Redchuk (at GL training courses)");
@@ -38,12 +45,53 @@ MODULE_VERSION("0.1");
  */
 #define BUTTON  GPIO_NUMBER(2, 8)
 
+/*
+ * Line numbers can be overridden to run against gpio-sim or gpio-mockup,
+ * whose global numbers depend on the chip base.
+ */
+static int button = BUTTON;
+module_param(button, int, 0444);
+MODULE_PARM_DESC(button, "Button GPIO number");
+
+static int led_high = LED_MMC;
+module_param(led_high, int, 0444);
+MODULE_PARM_DESC(led_high, "LED GPIO used when the button reads high at load");
+
+static int led_low = LED_SD;
+module_param(led_low, int, 0444);
+MODULE_PARM_DESC(led_low, "LED GPIO used when the button reads low at load");
+
+static char *mode = "auto";
+module_param(mode, charp, 0444);
+MODULE_PARM_DESC(mode, "irq, poll or auto (irq when the GPIO has one)");
+
+static unsigned int poll_min_ms = 10;
+module_param(poll_min_ms, uint, 0644);
+MODULE_PARM_DESC(poll_min_ms, "Poll interval while the button is changing");
+
+static unsigned int poll_max_ms = 1000;
+module_param(poll_max_ms, uint, 0644);
+MODULE_PARM_DESC(poll_max_ms, "Poll interval the backoff settles at when idle");
+
 static int led_gpio = -1;
+static int led_state;
 static int button_gpio = -1;
+static int button_irq = -1;
+
+/* Edges seen by the primary handler and not yet consumed by the thread */
+static atomic_t pending_edges = ATOMIC_INIT(0);
 
-static struct timer_list my_timer;
-static unsigned long start;
-static unsigned long delay_in_jiffies;
+static struct delayed_work poll_work;
+static unsigned int poll_ms;
+static int last_state;
+
+static struct dentry *root_dentry;
+
+/* Wakeups are handler runs; edges are button changes, presses falling ones */
+static unsigned long wakeups;
+static unsigned long edges;
+static unsigned long presses;
+static unsigned long start_jiffies;
 
 static int led_gpio_init(int gpio)
 {
@@ -57,40 +105,178 @@ static int led_gpio_init(int gpio)
 	return 0;
 }
 
-static void timer_callback(struct timer_list *timer)
+/* The LED toggles on every press (falling edge) */
+static void button_pressed(unsigned int n)
+{
+	presses += n;
+
+	if (n & 1) {
+		led_state = !led_state;
+		gpio_set_value_cansleep(led_gpio, led_state);
+	}
+}
+
+/* Poll mode: returns true if the button changed since the last sample */
+static bool button_sample(void)
 {
 	int button_state;
 
-	pr_info("timer_callback called (%lu). is atomic\n", jiffies);
-	pr_info("in atomic %d\n", in_atomic());
+	wakeups++;
+
+	button_state = gpio_get_value_cansleep(button_gpio);
+	if (button_state == last_state)
+		return false;
+
+	if (last_state && !button_state)
+		button_pressed(1);
+
+	last_state = button_state;
+	edges++;
+	pr_debug("button %d (%lu)\n", button_state, jiffies);
+	return true;
+}
+
+/* Primary handler: only count the edge, the GPIO may be on a sleeping chip */
+static irqreturn_t button_hard_intr(int irq, void *dev_id)
+{
+	atomic_inc(&pending_edges);
+
+	return IRQ_WAKE_THREAD;
+}
+
+/*
+ * Consumes the edges counted by the primary handler rather than reading
+ * the level back, so a press that is over before the thread runs still
+ * counts. Edges alternate, so their number and the level before them
+ * give the falling ones; the level is then re-read to resync.
+ */
+static irqreturn_t button_thread_intr(int irq, void *dev_id)
+{
+	unsigned int n = atomic_xchg(&pending_edges, 0);
+
+	wakeups++;
+	if (!n)
+		return IRQ_HANDLED;
+
+	edges += n;
+	button_pressed(last_state ? (n + 1) / 2 : n / 2);
+
+	last_state = gpio_get_value_cansleep(button_gpio);
+	pr_debug("button %d after %u edges (%lu)\n", last_state, n, jiffies);
+
+	return IRQ_HANDLED;
+}
+
+/*
+ * Fallback for lines without an IRQ: sample fast while the button is
+ * changing and double the interval up to poll_max_ms while it is idle.
+ * Runs from a workqueue so sleeping GPIO chips can be read.
+ */
+static void poll_work_fn(struct work_struct *work)
+{
+	unsigned int min_ms = max(poll_min_ms, 1U);
+	unsigned int max_ms = max(poll_max_ms, min_ms);
+
+	if (button_sample())
+		poll_ms = min_ms;
+	else
+		poll_ms = min(poll_ms * 2, max_ms);
+
+	queue_delayed_work(system_power_efficient_wq, &poll_work,
+			   msecs_to_jiffies(poll_ms));
+}
+
+static int poll_init(void)
+{
+	INIT_DELAYED_WORK(&poll_work, poll_work_fn);
+	poll_ms = max(poll_min_ms, 1U);
+
+	pr_info("Polling button, %u..%u ms\n", poll_min_ms, poll_max_ms);
+
+	queue_delayed_work(system_power_efficient_wq, &poll_work,
+			   msecs_to_jiffies(poll_ms));
+	return 0;
+}
+
+static int irq_init(int gpio)
+{
+	int irq;
+	int rc;
 
-	button_state = gpio_get_value(button_gpio);
+	irq = gpio_to_irq(gpio);
+	if (irq < 0)
+		return irq;
 
-	gpio_set_value(led_gpio, !button_state);
+	/* gpio-sim lines sleep, so all GPIO access is in the thread */
+	rc = request_threaded_irq(irq, button_hard_intr, button_thread_intr,
+				  IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING |
+				  IRQF_ONESHOT, "onboard_io_button", NULL);
+	if (rc)
+		return rc;
 
-	start += delay_in_jiffies;
-	mod_timer(timer, start);
+	button_irq = irq;
+	pr_info("Button IRQ %d on both edges\n", irq);
+	return 0;
 }
 
-static int timer_init(void)
+static int input_init(void)
 {
-	unsigned long now;
+	int rc;
 
-	delay_in_jiffies = msecs_to_jiffies(100);
+	start_jiffies = jiffies;
 
-	pr_info("Timer module installing\n");
+	if (sysfs_streq(mode, "poll"))
+		return poll_init();
 
-	timer_setup(&my_timer, timer_callback, 0);
+	rc = irq_init(button_gpio);
+	if (!rc)
+		return 0;
 
-	now = jiffies;
-	start = now + delay_in_jiffies;
+	if (sysfs_streq(mode, "irq")) {
+		pr_err("No IRQ for GPIO%d (%d)\n", button_gpio, rc);
+		return rc;
+	}
 
-	pr_info("Starting timer to fire in %lu ms (%lu)\n", start, now);
+	pr_info("No IRQ for GPIO%d (%d), falling back to polling\n",
+		button_gpio, rc);
+	return poll_init();
+}
 
-	mod_timer(&my_timer, start);
+static void input_deinit(void)
+{
+	if (button_irq >= 0)
+		free_irq(button_irq, NULL);
+	else
+		cancel_delayed_work_sync(&poll_work);
+}
 
+static int stats_show(struct seq_file *s, void *unused)
+{
+	unsigned long elapsed = jiffies - start_jiffies;
+	u64 rate_x100 = 0;
+	u32 frac;
+
+	if (elapsed)
+		rate_x100 = div64_u64((u64)wakeups * 100 * HZ, elapsed);
+
+	seq_printf(s, "mode: %s\n", button_irq >= 0 ? "irq" : "poll");
+	if (button_irq < 0)
+		seq_printf(s, "poll_ms: %u\n", poll_ms);
+	seq_printf(s, "wakeups: %lu\n", wakeups);
+	seq_printf(s, "edges: %lu\n", edges);
+	seq_printf(s, "presses: %lu\n", presses);
+	seq_printf(s, "seconds: %lu\n", elapsed / HZ);
+	seq_printf(s, "wakeups_per_sec: %llu.%02u\n",
+		   div_u64_rem(rate_x100, 100, &frac), frac);
 	return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(stats);
+
+static void debugfs_init(void)
+{
+	root_dentry = debugfs_create_dir(KBUILD_MODNAME, NULL);
+	debugfs_create_file("stats", 0444, root_dentry, NULL, &stats_fops);
+}
 
 static int button_gpio_init(int gpio)
 {
@@ -129,15 +315,16 @@ static int __init onboard_io_init(void)
 	int gpio;
 	int button_state;
 
-	rc = button_gpio_init(BUTTON);
+	rc = button_gpio_init(button);
 	if (rc) {
-		pr_err("Can't set GPIO%d for button\n", BUTTON);
+		pr_err("Can't set GPIO%d for button\n", button);
 		goto err_button;
 	}
 
-	button_state = gpio_get_value(button_gpio);
+	button_state = gpio_get_value_cansleep(button_gpio);
+	last_state = button_state;
 
-	gpio = button_state ? LED_MMC : LED_SD;
+	gpio = button_state ? led_high : led_low;
 	if (rc) {
 		pr_err("Can't set GPIO%d for output\n", gpio);
 		goto err_button;
@@ -149,15 +336,18 @@ static int __init onboard_io_init(void)
 		goto err_led;
 	}
 
-	gpio_set_value(led_gpio, 1);
+	led_state = 1;
+	gpio_set_value_cansleep(led_gpio, led_state);
 	pr_info("LED at GPIO%d ON\n", led_gpio);
 
-	rc = timer_init();
+	rc = input_init();
 	if (rc) {
-		pr_err("Can't set up timer\n");
+		pr_err("Can't set up button input\n");
 		goto err_led;
 	}
 
+	debugfs_init();
+
 	return 0;
 
 err_led:
@@ -168,11 +358,11 @@ err_button:
 
 static void __exit onboard_io_exit(void)
 {
-	if (del_timer(&my_timer))
-		pr_info("Рendng timer deleted\n");
+	debugfs_remove_recursive(root_dentry);
+	input_deinit();
 
 	if (led_gpio >= 0) {
-		gpio_set_value(led_gpio, 0);
+		gpio_set_value_cansleep(led_gpio, 0);
 		pr_info("LED at GPIO%d OFF\n", led_gpio);
 	}
 
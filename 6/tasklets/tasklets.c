@@ -34,82 +34,811 @@
 #include <linux/interrupt.h>
 #include <linux/workqueue.h>
 #include <linux/slab.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/percpu.h>
+#include <linux/cpumask.h>
+#include <linux/smp.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/math64.h>
+#include <linux/atomic.h>
+#include <linux/bitops.h>
+#include <linux/kthread.h>
+#include <linux/string.h>
+#include <linux/version.h>
+#include <linux/llist.h>
+#include <linux/irqflags.h>
+
+#define CREATE_TRACE_POINTS
+#include "tasklets_trace.h"
 
 MODULE_AUTHOR("Kirill Yatsenko <kirill.yatsenko@globallogic.com>");
 MODULE_DESCRIPTION("HM #6");
 MODULE_LICENSE("Dual BSD/GPL");
 
-#define MS_TO_NS(x)	((x) * NSEC_PER_MSEC)
+#define PERIOD_MIN_US	10
+
+/*
+ * Expiry statistics of one hrtimer. Jitter is actual minus programmed
+ * expiry; overruns are periods skipped because the callback ran late.
+ */
+struct hrt_stats {
+	u64 expiries;
+	u64 overruns;
+	s64 jitter_min;
+	s64 jitter_max;
+	u64 jitter_abs_sum;
+	struct u64_stats_sync syncp;
+};
+
+struct hrt_ctx {
+	struct hrtimer timer;
+	int cpu;
+	struct hrt_stats stats;
+};
+
+/* Pipeline stages whose latency is recorded */
+enum lat_stage {
+	STAGE_TIMER_TASKLET,
+	STAGE_TIMER_HI_TASKLET,
+	STAGE_TIMER_BH_WQ,
+	STAGE_TIMER_HIGHPRI_WQ,
+	STAGE_TIMER_KTHREAD,
+	STAGE_DEFERRED_WORK,
+	STAGE_DWORK_LATE,
+	NR_STAGES,
+};
+
+static const char * const stage_names[NR_STAGES] = {
+	[STAGE_TIMER_TASKLET]	 = "timer_to_tasklet",
+	[STAGE_TIMER_HI_TASKLET] = "timer_to_hi_tasklet",
+	[STAGE_TIMER_BH_WQ]	 = "timer_to_bh_wq",
+	[STAGE_TIMER_HIGHPRI_WQ] = "timer_to_highpri_wq",
+	[STAGE_TIMER_KTHREAD]	 = "timer_to_kthread",
+	[STAGE_DEFERRED_WORK]	 = "deferred_to_work",
+	[STAGE_DWORK_LATE]	 = "delayed_work_lateness",
+};
+
+/* Bucket i counts latencies in [2^(i-1), 2^i) ns, bucket 0 counts <= 0 */
+#define LAT_BUCKETS	64
 
-struct hrtimer hr_timer;
-struct tasklet_struct tlet;
-struct tasklet_struct hi_tlet;
+struct lat_hist {
+	u64 buckets[NR_STAGES][LAT_BUCKETS];
+};
+
+static DEFINE_PER_CPU(struct lat_hist, lat_hist);
+
+/*
+ * A stamp is taken when a stage is scheduled and consumed when it runs.
+ * Only the first producer stamps a pending stage, so coalesced requests
+ * are measured from the oldest one.
+ */
+struct stage_stamp {
+	atomic64_t ns;
+	enum lat_stage stage;
+};
+
+/*
+ * One way of getting from the hrtimer into deferred context. Every
+ * backend runs the same deferred_cb(), so they differ only in how
+ * quickly and where that callback gets to run.
+ */
+struct deferral_backend {
+	const char *name;
+	int (*setup)(struct deferral_backend *b);
+	void (*kick)(struct deferral_backend *b);
+	void (*teardown)(struct deferral_backend *b);
+	struct stage_stamp stamp;
+	bool enabled;
+
+	struct tasklet_struct tlet;
+	struct work_struct work;
+	struct workqueue_struct *wq;
+	struct task_struct *task;
+	atomic_t pending;
+};
+
+/* A deferred event waiting in a per-CPU batch */
+struct batch_event {
+	struct llist_node node;
+	u64 ts;
+};
+
+/*
+ * Per-CPU batching stage. Events are taken from a preallocated free
+ * list, queued on pending and drained by one work invocation. The free
+ * list is only popped on its own CPU with interrupts off, which keeps
+ * llist_del_first() single-consumer.
+ */
+struct batch_cpu {
+	struct llist_head pending;
+	struct llist_head free;
+	atomic_t nr_pending;
+	struct delayed_work drain;
+	struct batch_event *pool;
+	int cpu;
+
+	atomic_long_t coalesced;
+	atomic_long_t dropped;
+	atomic_long_t drained;
+} ____cacheline_aligned_in_smp;
+
+/* Holds the expected due time rather than the scheduling time */
+static struct stage_stamp dwork_stamp = {
+	.ns = ATOMIC64_INIT(0), .stage = STAGE_DWORK_LATE,
+};
 
-struct work_struct work;
 struct delayed_work delayed_work;
+static atomic_long_t dwork_coalesced;
+
+static DEFINE_PER_CPU(struct batch_cpu, batch_cpu);
 
 static unsigned long delay_in_ms = 200L;
 
-static void workqueue_cb(struct work_struct *work)
+static char *backends = "tasklet,hi_tasklet";
+module_param(backends, charp, 0444);
+MODULE_PARM_DESC(backends,
+		 "Comma list of: tasklet, hi_tasklet, bh_wq, highpri_wq, kthread");
+
+static bool periodic;
+module_param(periodic, bool, 0444);
+MODULE_PARM_DESC(periodic, "Re-arm the timer every period_us instead of firing once");
+
+static unsigned long period_us = 200000;
+module_param(period_us, ulong, 0444);
+MODULE_PARM_DESC(period_us, "Timer period in microseconds (min 10)");
+
+static bool pinned;
+module_param(pinned, bool, 0444);
+MODULE_PARM_DESC(pinned, "One HRTIMER_MODE_ABS_PINNED timer per online CPU");
+
+static struct hrt_ctx hrt_global;
+static DEFINE_PER_CPU(struct hrt_ctx, hrt_pcpu);
+static struct cpumask hrt_cpus;
+static ktime_t hrt_period;
+
+static unsigned int max_batch = 32;
+module_param(max_batch, uint, 0644);
+MODULE_PARM_DESC(max_batch, "Drain a CPU's batch as soon as it holds this many events");
+
+static unsigned int max_delay_ms;
+module_param(max_delay_ms, uint, 0644);
+MODULE_PARM_DESC(max_delay_ms, "Longest time an event may wait for its batch to drain");
+
+static unsigned int batch_pool = 256;
+module_param(batch_pool, uint, 0444);
+MODULE_PARM_DESC(batch_pool, "Preallocated events per CPU; submissions beyond it are dropped");
+
+static struct dentry *root_dentry;
+
+static void lat_record(enum lat_stage stage, s64 ns)
+{
+	unsigned int bucket = ns > 0 ? min(fls64(ns), LAT_BUCKETS - 1) : 0;
+
+	this_cpu_inc(lat_hist.buckets[stage][bucket]);
+	trace_tasklets_stage_latency(stage_names[stage], ns);
+}
+
+static void stamp_set(struct stage_stamp *st, u64 ns)
+{
+	atomic64_cmpxchg(&st->ns, 0, ns);
+}
+
+static void stamp_consume(struct stage_stamp *st)
+{
+	u64 now = ktime_get_ns();
+	u64 then = atomic64_xchg(&st->ns, 0);
+
+	if (then)
+		lat_record(st->stage, (s64)(now - then));
+}
+
+static void batch_drain(struct work_struct *work)
+{
+	struct batch_cpu *bc = container_of(to_delayed_work(work),
+					    struct batch_cpu, drain);
+	struct llist_node *first, *last = NULL;
+	struct batch_event *ev;
+	u64 now = ktime_get_ns();
+	int nr = 0;
+
+	first = llist_del_all(&bc->pending);
+	if (!first)
+		return;
+
+	llist_for_each_entry(ev, first, node) {
+		lat_record(STAGE_DEFERRED_WORK, (s64)(now - ev->ts));
+		last = &ev->node;
+		nr++;
+	}
+
+	atomic_sub(nr, &bc->nr_pending);
+	atomic_long_add(nr, &bc->drained);
+	llist_add_batch(first, last, &bc->free);
+
+	pr_debug("drained %d events on cpu %d (%ums)\n", nr, bc->cpu,
+		 jiffies_to_msecs(jiffies));
+}
+
+/*
+ * Queue one event on this CPU's batch. Only the event that opens a batch
+ * or fills it up touches the workqueue; the rest are counted as coalesced.
+ */
+static void batch_submit(u64 ts)
+{
+	struct batch_cpu *bc;
+	struct llist_node *node;
+	struct batch_event *ev;
+	unsigned long flags;
+	int cpu;
+
+	local_irq_save(flags);
+	cpu = smp_processor_id();
+	bc = this_cpu_ptr(&batch_cpu);
+
+	node = llist_del_first(&bc->free);
+	if (!node) {
+		atomic_long_inc(&bc->dropped);
+		goto out;
+	}
+
+	ev = llist_entry(node, struct batch_event, node);
+	ev->ts = ts;
+
+	if (llist_add(&ev->node, &bc->pending)) {
+		atomic_inc(&bc->nr_pending);
+		queue_delayed_work_on(cpu, system_wq, &bc->drain,
+				      msecs_to_jiffies(max_delay_ms));
+	} else if (atomic_inc_return(&bc->nr_pending) >= max_batch) {
+		mod_delayed_work_on(cpu, system_wq, &bc->drain, 0);
+	} else {
+		atomic_long_inc(&bc->coalesced);
+	}
+out:
+	local_irq_restore(flags);
+}
+
+static void batch_destroy(void)
 {
-	unsigned int ms = jiffies_to_msecs(jiffies);
+	int cpu;
 
-	pr_info("called (%dms)\n", ms);
+	for_each_possible_cpu(cpu) {
+		struct batch_cpu *bc = per_cpu_ptr(&batch_cpu, cpu);
+
+		cancel_delayed_work_sync(&bc->drain);
+		kfree(bc->pool);
+		bc->pool = NULL;
+	}
 }
 
-static void tasklet_cb(unsigned long arg)
+static int batch_init(void)
+{
+	unsigned int i;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct batch_cpu *bc = per_cpu_ptr(&batch_cpu, cpu);
+
+		bc->cpu = cpu;
+		init_llist_head(&bc->pending);
+		init_llist_head(&bc->free);
+		INIT_DELAYED_WORK(&bc->drain, batch_drain);
+	}
+
+	for_each_possible_cpu(cpu) {
+		struct batch_cpu *bc = per_cpu_ptr(&batch_cpu, cpu);
+
+		bc->pool = kcalloc_node(batch_pool, sizeof(*bc->pool),
+					GFP_KERNEL, cpu_to_node(cpu));
+		if (!bc->pool) {
+			batch_destroy();
+			return -ENOMEM;
+		}
+
+		for (i = 0; i < batch_pool; i++)
+			llist_add(&bc->pool[i].node, &bc->free);
+	}
+
+	return 0;
+}
+
+static void delayed_work_cb(struct work_struct *work)
+{
+	stamp_consume(&dwork_stamp);
+
+	pr_debug("delayed work called (%ums)\n", jiffies_to_msecs(jiffies));
+}
+
+static void deferred_cb(struct deferral_backend *b)
 {
 	unsigned long delay;
-	char *message = (char *)arg;
+	u64 now;
 
-	pr_info("%s: %lu\n", message, jiffies);
+	stamp_consume(&b->stamp);
+
+	pr_debug("%s: %lu\n", b->name, jiffies);
 
 	delay = msecs_to_jiffies(delay_in_ms);
+	now = ktime_get_ns();
+
+	batch_submit(now);
+
+	stamp_set(&dwork_stamp, now + jiffies_to_nsecs(delay));
+	if (!schedule_delayed_work(&delayed_work, delay))
+		atomic_long_inc(&dwork_coalesced);
+}
+
+static void backend_tasklet_fn(unsigned long arg)
+{
+	deferred_cb((struct deferral_backend *)arg);
+}
+
+static int tasklet_backend_setup(struct deferral_backend *b)
+{
+	tasklet_init(&b->tlet, backend_tasklet_fn, (unsigned long)b);
+	return 0;
+}
+
+static void tasklet_kick(struct deferral_backend *b)
+{
+	tasklet_schedule(&b->tlet);
+}
+
+static void hi_tasklet_kick(struct deferral_backend *b)
+{
+	tasklet_hi_schedule(&b->tlet);
+}
+
+static void tasklet_teardown(struct deferral_backend *b)
+{
+	tasklet_kill(&b->tlet);
+}
+
+static void backend_work_fn(struct work_struct *work)
+{
+	deferred_cb(container_of(work, struct deferral_backend, work));
+}
+
+static int bh_wq_setup(struct deferral_backend *b)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 9, 0)
+	INIT_WORK(&b->work, backend_work_fn);
+	b->wq = system_bh_wq;
+	return 0;
+#else
+	pr_err("bh_wq needs WQ_BH (Linux 6.9+)\n");
+	return -EOPNOTSUPP;
+#endif
+}
+
+static int highpri_wq_setup(struct deferral_backend *b)
+{
+	INIT_WORK(&b->work, backend_work_fn);
+	b->wq = alloc_workqueue("tasklets_highpri", WQ_HIGHPRI, 0);
+	if (!b->wq)
+		return -ENOMEM;
+
+	return 0;
+}
+
+static void wq_kick(struct deferral_backend *b)
+{
+	queue_work(b->wq, &b->work);
+}
+
+static void bh_wq_teardown(struct deferral_backend *b)
+{
+	cancel_work_sync(&b->work);
+}
+
+static void highpri_wq_teardown(struct deferral_backend *b)
+{
+	cancel_work_sync(&b->work);
+	destroy_workqueue(b->wq);
+}
+
+static int backend_thread_fn(void *data)
+{
+	struct deferral_backend *b = data;
+
+	for (;;) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (kthread_should_stop())
+			break;
 
-	schedule_work(&work);
-	schedule_delayed_work(&delayed_work, delay);
+		if (!atomic_xchg(&b->pending, 0)) {
+			schedule();
+			continue;
+		}
+
+		__set_current_state(TASK_RUNNING);
+		deferred_cb(b);
+	}
+	__set_current_state(TASK_RUNNING);
+
+	return 0;
+}
+
+static int kthread_backend_setup(struct deferral_backend *b)
+{
+	atomic_set(&b->pending, 0);
+	b->task = kthread_run(backend_thread_fn, b, "tasklets_kthread");
+	if (IS_ERR(b->task))
+		return PTR_ERR(b->task);
+
+	return 0;
+}
+
+static void kthread_backend_kick(struct deferral_backend *b)
+{
+	atomic_set(&b->pending, 1);
+	wake_up_process(b->task);
+}
+
+static void kthread_backend_teardown(struct deferral_backend *b)
+{
+	kthread_stop(b->task);
+}
+
+#define BACKEND(_name, _stage, _setup, _kick, _teardown)		\
+	{								\
+		.name = _name,						\
+		.setup = _setup,					\
+		.kick = _kick,						\
+		.teardown = _teardown,					\
+		.stamp = { .ns = ATOMIC64_INIT(0), .stage = _stage },	\
+	}
+
+static struct deferral_backend deferral_backends[] = {
+	BACKEND("tasklet", STAGE_TIMER_TASKLET,
+		tasklet_backend_setup, tasklet_kick, tasklet_teardown),
+	BACKEND("hi_tasklet", STAGE_TIMER_HI_TASKLET,
+		tasklet_backend_setup, hi_tasklet_kick, tasklet_teardown),
+	BACKEND("bh_wq", STAGE_TIMER_BH_WQ,
+		bh_wq_setup, wq_kick, bh_wq_teardown),
+	BACKEND("highpri_wq", STAGE_TIMER_HIGHPRI_WQ,
+		highpri_wq_setup, wq_kick, highpri_wq_teardown),
+	BACKEND("kthread", STAGE_TIMER_KTHREAD,
+		kthread_backend_setup, kthread_backend_kick,
+		kthread_backend_teardown),
+};
+
+static struct deferral_backend *find_backend(const char *name)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(deferral_backends); i++)
+		if (sysfs_streq(name, deferral_backends[i].name))
+			return &deferral_backends[i];
+
+	return NULL;
+}
+
+static int backends_parse(void)
+{
+	struct deferral_backend *b;
+	char *copy, *cur, *tok;
+	int nr = 0;
+	int ret = 0;
+
+	copy = kstrdup(backends, GFP_KERNEL);
+	if (!copy)
+		return -ENOMEM;
+
+	cur = copy;
+	while ((tok = strsep(&cur, ",")) != NULL) {
+		if (!*tok)
+			continue;
+
+		b = find_backend(tok);
+		if (!b) {
+			pr_err("Unknown backend: %s\n", tok);
+			ret = -EINVAL;
+			goto out;
+		}
+		b->enabled = true;
+		nr++;
+	}
+
+	if (!nr) {
+		pr_err("No backend selected\n");
+		ret = -EINVAL;
+	}
+out:
+	kfree(copy);
+	return ret;
+}
+
+static int backends_init(void)
+{
+	int ret;
+	int i;
+
+	ret = backends_parse();
+	if (ret)
+		return ret;
+
+	for (i = 0; i < ARRAY_SIZE(deferral_backends); i++) {
+		struct deferral_backend *b = &deferral_backends[i];
+
+		if (!b->enabled)
+			continue;
+
+		ret = b->setup(b);
+		if (ret)
+			goto err_setup;
+
+		pr_info("Backend %s enabled\n", b->name);
+	}
+
+	return 0;
+
+err_setup:
+	while (i--)
+		if (deferral_backends[i].enabled)
+			deferral_backends[i].teardown(&deferral_backends[i]);
+	return ret;
+}
+
+static void backends_deinit(void)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(deferral_backends); i++)
+		if (deferral_backends[i].enabled)
+			deferral_backends[i].teardown(&deferral_backends[i]);
+}
+
+static void hrt_account(struct hrt_ctx *ctx, s64 jitter, u64 overruns)
+{
+	struct hrt_stats *st = &ctx->stats;
+
+	u64_stats_update_begin(&st->syncp);
+	if (!st->expiries || jitter < st->jitter_min)
+		st->jitter_min = jitter;
+	if (!st->expiries || jitter > st->jitter_max)
+		st->jitter_max = jitter;
+	st->jitter_abs_sum += abs(jitter);
+	st->overruns += overruns;
+	st->expiries++;
+	u64_stats_update_end(&st->syncp);
 }
 
 static enum hrtimer_restart hrt_cb( struct hrtimer *timer)
 {
-	pr_info("hrt_cb called (%llu).\n",
-		ktime_to_ms(timer->base->get_time()));
+	struct hrt_ctx *ctx = container_of(timer, struct hrt_ctx, timer);
+	ktime_t now = ktime_get();
+	s64 jitter = ktime_to_ns(ktime_sub(now, hrtimer_get_expires(timer)));
+	u64 overruns = 0;
+	int i;
+
+	pr_debug("hrt_cb called (%llu).\n", ktime_to_ms(now));
+
+	pr_debug("Kicking deferral backends...\n");
+
+	for (i = 0; i < ARRAY_SIZE(deferral_backends); i++) {
+		struct deferral_backend *b = &deferral_backends[i];
+
+		if (!b->enabled)
+			continue;
 
-	pr_info("Scheduling tasklets...\n");
+		stamp_set(&b->stamp, ktime_to_ns(now));
+		b->kick(b);
+	}
 
-	tasklet_schedule(&tlet);
-	tasklet_hi_schedule(&hi_tlet);
+	/*
+	 * Forwarding from the programmed expiry keeps the timer on its
+	 * original grid, so callback latency never accumulates as drift.
+	 */
+	if (periodic)
+		overruns = hrtimer_forward_now(timer, hrt_period) - 1;
 
-	return HRTIMER_NORESTART;
+	hrt_account(ctx, jitter, overruns);
+
+	return periodic ? HRTIMER_RESTART : HRTIMER_NORESTART;
+}
+
+static void hrt_ctx_init(struct hrt_ctx *ctx, int cpu, enum hrtimer_mode mode)
+{
+	ctx->cpu = cpu;
+	u64_stats_init(&ctx->stats.syncp);
+	hrtimer_init(&ctx->timer, CLOCK_MONOTONIC, mode);
+	ctx->timer.function = &hrt_cb;
+}
+
+/* Runs on the target CPU, so the pinned timer stays there */
+static void hrt_start_pinned(void *info)
+{
+	struct hrt_ctx *ctx = this_cpu_ptr(&hrt_pcpu);
+	ktime_t *first = info;
+
+	hrt_ctx_init(ctx, smp_processor_id(), HRTIMER_MODE_ABS_PINNED);
+	hrtimer_start(&ctx->timer, *first, HRTIMER_MODE_ABS_PINNED);
 }
 
 static void hrt_init(void)
 {
-	ktime_t ktime;
+	ktime_t first;
+	int cpu;
 
 	pr_info("Setuping hr timer\n");
 
-	ktime = ktime_set(0, MS_TO_NS(delay_in_ms));
-	hrtimer_init(&hr_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
-	hr_timer.function = &hrt_cb;
+	hrt_period = ns_to_ktime(max_t(unsigned long, period_us, PERIOD_MIN_US) *
+				 NSEC_PER_USEC);
 
-	pr_info("Starting timer to fire in %llu ms (%lu)\n",
-		ktime_to_ms(hr_timer.base->get_time()) + delay_in_ms, jiffies);
+	if (!pinned) {
+		hrt_ctx_init(&hrt_global, -1, HRTIMER_MODE_REL);
 
-	hrtimer_start(&hr_timer, ktime, HRTIMER_MODE_REL);
+		pr_info("Starting timer to fire in %llu ms (%lu)\n",
+			ktime_to_ms(hrt_period), jiffies);
+
+		hrtimer_start(&hrt_global.timer, hrt_period, HRTIMER_MODE_REL);
+		return;
+	}
+
+	/* All CPUs share one absolute grid */
+	first = ktime_add(ktime_get(), hrt_period);
+
+	cpus_read_lock();
+	cpumask_copy(&hrt_cpus, cpu_online_mask);
+	for_each_cpu(cpu, &hrt_cpus)
+		smp_call_function_single(cpu, hrt_start_pinned, &first, 1);
+	cpus_read_unlock();
+
+	pr_info("Started pinned timers on %u CPUs, period %lu us\n",
+		cpumask_weight(&hrt_cpus), period_us);
+}
+
+static void hrt_deinit(void)
+{
+	int cpu;
+	int ret;
+
+	if (!pinned) {
+		ret = hrtimer_cancel(&hrt_global.timer);
+		if (ret)
+			pr_info("The timer was still in use...\n");
+		return;
+	}
+
+	for_each_cpu(cpu, &hrt_cpus)
+		hrtimer_cancel(&per_cpu_ptr(&hrt_pcpu, cpu)->timer);
+}
+
+static void jitter_show_one(struct seq_file *s, struct hrt_ctx *ctx)
+{
+	struct hrt_stats *st = &ctx->stats;
+	u64 expiries, overruns, abs_sum;
+	s64 jmin, jmax;
+	unsigned int start;
+
+	do {
+		start = u64_stats_fetch_begin(&st->syncp);
+		expiries = st->expiries;
+		overruns = st->overruns;
+		jmin = st->jitter_min;
+		jmax = st->jitter_max;
+		abs_sum = st->jitter_abs_sum;
+	} while (u64_stats_fetch_retry(&st->syncp, start));
+
+	seq_printf(s, "%4d %12llu %10llu %12lld %12lld %12llu\n", ctx->cpu,
+		   expiries, overruns, jmin, jmax,
+		   expiries ? div64_u64(abs_sum, expiries) : 0);
+}
+
+static int jitter_show(struct seq_file *s, void *unused)
+{
+	int cpu;
+
+	seq_printf(s, "period: %lld ns\n", ktime_to_ns(hrt_period));
+	seq_printf(s, "%4s %12s %10s %12s %12s %12s\n", "cpu", "expiries",
+		   "overruns", "min_ns", "max_ns", "mean_abs_ns");
+
+	if (!pinned) {
+		jitter_show_one(s, &hrt_global);
+		return 0;
+	}
+
+	for_each_cpu(cpu, &hrt_cpus)
+		jitter_show_one(s, per_cpu_ptr(&hrt_pcpu, cpu));
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(jitter);
+
+static int latency_show(struct seq_file *s, void *unused)
+{
+	u64 sum[LAT_BUCKETS];
+	u64 total;
+	int stage, i, cpu;
+
+	for (stage = 0; stage < NR_STAGES; stage++) {
+		memset(sum, 0, sizeof(sum));
+		total = 0;
+
+		for_each_possible_cpu(cpu) {
+			struct lat_hist *h = per_cpu_ptr(&lat_hist, cpu);
+
+			for (i = 0; i < LAT_BUCKETS; i++)
+				sum[i] += READ_ONCE(h->buckets[stage][i]);
+		}
+		for (i = 0; i < LAT_BUCKETS; i++)
+			total += sum[i];
+
+		seq_printf(s, "%s: %llu samples\n", stage_names[stage], total);
+		for (i = 0; i < LAT_BUCKETS; i++) {
+			if (!sum[i])
+				continue;
+			if (!i)
+				seq_printf(s, "  %20s %12llu\n", "<= 0 ns", sum[i]);
+			else
+				seq_printf(s, "  < %15llu ns %12llu\n",
+					   1ULL << i, sum[i]);
+		}
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(latency);
+
+static int batch_show(struct seq_file *s, void *unused)
+{
+	long coalesced = 0, dropped = 0, drained = 0;
+	int cpu;
+
+	seq_printf(s, "max_batch: %u max_delay_ms: %u pool: %u\n",
+		   max_batch, max_delay_ms, batch_pool);
+	seq_printf(s, "%4s %12s %12s %12s\n", "cpu", "coalesced", "dropped",
+		   "drained");
+
+	for_each_online_cpu(cpu) {
+		struct batch_cpu *bc = per_cpu_ptr(&batch_cpu, cpu);
+		long c = atomic_long_read(&bc->coalesced);
+		long d = atomic_long_read(&bc->dropped);
+		long n = atomic_long_read(&bc->drained);
+
+		seq_printf(s, "%4d %12ld %12ld %12ld\n", cpu, c, d, n);
+		coalesced += c;
+		dropped += d;
+		drained += n;
+	}
+
+	seq_printf(s, "%4s %12ld %12ld %12ld\n", "all", coalesced, dropped,
+		   drained);
+	seq_printf(s, "delayed_work coalesced: %ld\n",
+		   atomic_long_read(&dwork_coalesced));
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(batch);
+
+static void debugfs_init(void)
+{
+	root_dentry = debugfs_create_dir(KBUILD_MODNAME, NULL);
+	debugfs_create_file("jitter", 0444, root_dentry, NULL, &jitter_fops);
+	debugfs_create_file("latency", 0444, root_dentry, NULL, &latency_fops);
+	debugfs_create_file("batch", 0444, root_dentry, NULL, &batch_fops);
 }
 
 static int __init tasklets_init(void)
 {
-	char *regular = "regular";
-	char *hi = "hi";
+	int ret;
 
-	INIT_WORK(&work, workqueue_cb);
-	INIT_DELAYED_WORK(&delayed_work, workqueue_cb);
+	INIT_DELAYED_WORK(&delayed_work, delayed_work_cb);
 
-	tasklet_init(&tlet, tasklet_cb, (unsigned long)regular);
-	tasklet_init(&hi_tlet, tasklet_cb, (unsigned long)hi);
+	ret = batch_init();
+	if (ret)
+		return ret;
 
+	ret = backends_init();
+	if (ret) {
+		batch_destroy();
+		return ret;
+	}
+
+	debugfs_init();
 	hrt_init();
 
 	return 0;
@@ -117,15 +846,14 @@ static int __init tasklets_init(void)
 
 static void __exit tasklets_exit(void)
 {
-	int ret;
+	hrt_deinit();
 
-	tasklet_kill(&tlet);
-	tasklet_kill(&hi_tlet);
+	debugfs_remove_recursive(root_dentry);
 
-	ret = hrtimer_cancel(&hr_timer);
-	if (ret)
-		pr_info("The timer was still in use...\n");
+	backends_deinit();
 
+	batch_destroy();
+	cancel_delayed_work_sync(&delayed_work);
 	flush_scheduled_work();
 }
 
@@ -0,0 +1,43 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM tasklets
+
+#if !defined(_TASKLETS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TASKLETS_TRACE_H
+
+#include <linux/tracepoint.h>
+#include <linux/version.h>
+
+/* One event per completed pipeline stage, latency in nanoseconds */
+TRACE_EVENT(tasklets_stage_latency,
+
+	TP_PROTO(const char *stage, s64 latency_ns),
+
+	TP_ARGS(stage, latency_ns),
+
+	TP_STRUCT__entry(
+		__string(stage, stage)
+		__field(s64, latency_ns)
+	),
+
+	TP_fast_assign(
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 10, 0)
+		__assign_str(stage);
+#else
+		__assign_str(stage, stage);
+#endif
+		__entry->latency_ns = latency_ns;
+	),
+
+	TP_printk("stage=%s latency_ns=%lld", __get_str(stage),
+		  __entry->latency_ns)
+);
+
+#endif /* _TASKLETS_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE tasklets_trace
+#include <trace/define_trace.h>
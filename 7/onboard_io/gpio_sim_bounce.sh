@@ -0,0 +1,82 @@
+#!/bin/sh
+# Bounce a gpio-sim line to exercise the onboard_io software debounce.
+#
+# usage: gpio_sim_bounce.sh [presses] [bounces] [debounce_us] [line]
+#
+# Creates a gpio-sim chip (if not there yet), loads onboard_io on its
+# line with sw_debounce=1, then emulates presses. A press is a burst of
+# bounces low/high pairs ending low, held for 0.5 s; a release is a
+# burst of bounces high/low pairs ending high, held for 0.5 s.
+#
+# The shell cannot toggle a line in microseconds: each edge is an echo
+# to sysfs, anywhere from tens of microseconds to a few milliseconds
+# apart. debounce_us therefore defaults to 50 ms, well above that gap and
+# well below the hold time, and storm protection is disabled so the
+# bursts reach the debouncer. With those settings the expected counts are
+#
+#	accepted = presses
+#	released = presses
+#	rejected = presses * (2 * bounces - 1)
+#
+# A press burst has bounces + 1 falling edges (one starts the burst, the
+# rest are rejected, it settles low and is accepted). A release burst has
+# bounces falling edges (bounces - 1 rejected, it settles high and is
+# counted as released). A scheduling stall longer than debounce_us in the
+# middle of a burst splits it and shows up as extra accepted or released.
+
+PRESSES=${1:-10}
+BOUNCES=${2:-20}
+DEBOUNCE_US=${3:-50000}
+LINE=${4:-0}
+
+CFG=/sys/kernel/config/gpio-sim/onboard_io_test
+STATS=/sys/kernel/debug/onboard_io/onboard_io0/latency
+
+set -e
+
+if [ "$BOUNCES" -lt 1 ]; then
+	echo "bounces must be at least 1" >&2
+	exit 1
+fi
+
+modprobe gpio-sim
+
+if [ ! -d $CFG ]; then
+	mkdir -p $CFG/bank0/line$LINE
+	echo 8 > $CFG/bank0/num_lines
+	echo 1 > $CFG/live
+fi
+
+CHIP=$(cat $CFG/bank0/chip_name)
+# "gpiochipN: GPIOs 512-519, parent: platform/gpio-sim.0, ..."
+BASE=$(grep "^$CHIP:" /sys/kernel/debug/gpio | sed 's/.*GPIOs \([0-9]*\)-.*/\1/')
+PULL=/sys/bus/gpio/devices/$CHIP/sim_gpio$LINE/pull
+
+echo pull-up > $PULL
+insmod onboard_io/onboard_io.ko inputs=$((BASE + LINE)) outputs=$((BASE + LINE + 1)) \
+	sw_debounce=1 debounce_us=$DEBOUNCE_US storm_rate=0
+
+# Back to back writes, as fast as the shell goes
+burst() {
+	b=0
+	while [ $b -lt $BOUNCES ]; do
+		echo $1 > $PULL
+		echo $2 > $PULL
+		b=$((b + 1))
+	done
+	echo $1 > $PULL
+}
+
+p=0
+while [ $p -lt $PRESSES ]; do
+	burst pull-down pull-up
+	sleep 0.5
+	burst pull-up pull-down
+	sleep 0.5
+	p=$((p + 1))
+done
+
+echo "expected: accepted $PRESSES rejected $((PRESSES * (2 * BOUNCES - 1))) released $PRESSES"
+grep '^debounce:' $STATS
+cat $STATS
+rmmod onboard_io
@@ -15,6 +15,28 @@
 #include <linux/interrupt.h>
 #include <linux/debugfs.h>
 #include <linux/delay.h>
+#include <linux/kfifo.h>
+#include <linux/ktime.h>
+#include <linux/workqueue.h>
+#include <linux/seq_file.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/mutex.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/eventfd.h>
+#include <linux/uaccess.h>
+#include <linux/version.h>
+#include <linux/slab.h>
+#include <linux/cache.h>
+#include <linux/hrtimer.h>
+#include <linux/spinlock.h>
+
+#include "onboard_io.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Oleksandr Redchuk (at GL training courses)");
@@ -42,43 +64,499 @@ MODULE_VERSION("0.1");
  */
 #define BUTTON  GPIO_NUMBER(2, 8)
 
-struct my_irq_data {
-	int led_state;
-};
+#define MAX_LINES	64
 
-struct my_irq_data my_irq_data;
-struct dentry droot;
+#define LAT_BUCKETS	32
 
-struct dentry *root_dentry;
-struct dentry *counter_dentry;
+/* Bucket i counts samples in [2^(i-1), 2^i) ns; racy reads are fine */
+struct lat_stats {
+	u64 count;
+	u64 sum;
+	u64 min;
+	u64 max;
+	u32 buckets[LAT_BUCKETS];
+};
 
-static u32 counter = 0;
-static int led_gpio = -1;
-static int button_gpio = -1;
-static int button_irq = -1;
+struct edge_ring {
+	struct edge_ring_hdr *hdr;
+	struct button_event *entries;
+	u32 mask;
+	u32 head;
+	u32 seq;
+	unsigned long dropped;
+
+	/* Signalled when the backlog reaches threshold */
+	struct mutex efd_lock;
+	struct eventfd_ctx *efd;
+	u32 threshold;
+	u32 last_pending;
+};
+
+/*
+ * State of one input line. Everything its IRQ path touches lives here,
+ * and lines come from a SLAB_HWCACHE_ALIGN cache, so lines serviced on
+ * different CPUs never share a cache line.
+ *
+ * event_fifo carries edge stamps from the top half to the thread;
+ * stream_fifo carries records from the thread to read(). Each has a
+ * single producer and a single consumer (readers serialize on
+ * stream_read_lock), so neither needs a lock.
+ */
+struct input_line {
+	int index;
+	int gpio;
+	int irq;
+	int led_gpio;
+	int led_state;
+	u32 counter;
+	bool irq_requested;
+
+	DECLARE_KFIFO(event_fifo, u64, 64);
+	unsigned long events_dropped;
+
+	/* Top half run time, and edge to threaded handler */
+	struct lat_stats hardirq_lat;
+	struct lat_stats thread_lat;
+
+	DECLARE_KFIFO(stream_fifo, struct button_event, 256);
+	wait_queue_head_t stream_wait;
+	struct mutex stream_read_lock;
+	u32 stream_seq;
+	unsigned long stream_dropped;
+
+	struct edge_ring ring;
+
+	struct work_struct busy_work;
+
+	/*
+	 * Software debounce, used when the controller has none. The top
+	 * half only stamps the edge; the timer re-arms itself until the
+	 * line has been quiet for debounce_us and then hands the burst to
+	 * the thread. The thread reads the settled level (the chip may
+	 * sleep) and reports one event stamped with the first edge only if
+	 * the line stayed low, so release bounce is not a press.
+	 */
+	bool sw_debounce;
+	raw_spinlock_t db_lock;
+	struct hrtimer db_timer;
+	bool db_pending;
+	u64 db_first;
+	u64 db_last;
+	bool db_settled;
+	u64 db_settled_ts;
+	unsigned long db_accepted;
+	unsigned long db_rejected;
+	unsigned long db_released;
+
+	/*
+	 * Storm protection. The top half counts edges per STORM_WINDOW_NS;
+	 * above the storm_rate budget it masks the IRQ and storm_work
+	 * samples the line instead, counting sampled edges per
+	 * storm_window_ms in the same win_* fields, until the rate drops
+	 * below storm_exit_rate(). cur_rate is the last full window.
+	 */
+	bool storm;
+	u64 win_start;
+	u32 win_edges;
+	u32 cur_rate;
+	u32 peak_rate;
+	int last_level;
+	struct delayed_work storm_work;
+	unsigned long storms;
+	unsigned long storm_exits;
+	unsigned long sampled_edges;
+
+	char name[16];
+	struct miscdevice dev;
+	bool dev_registered;
+} ____cacheline_aligned_in_smp;
+
+static int inputs[MAX_LINES] = { BUTTON };
+static int nr_inputs = 1;
+module_param_array(inputs, int, &nr_inputs, 0444);
+MODULE_PARM_DESC(inputs, "Input GPIO numbers, one IRQ, device and stats set each");
+
+static int outputs[MAX_LINES];
+static int nr_outputs;
+module_param_array(outputs, int, &nr_outputs, 0444);
+MODULE_PARM_DESC(outputs, "Output GPIOs, input i toggles output i % count");
+
+static unsigned int ring_size = 1024;
+module_param(ring_size, uint, 0444);
+MODULE_PARM_DESC(ring_size, "Records in the mmap ring, rounded up to a power of two");
+
+static unsigned int debounce_us = 200;
+module_param(debounce_us, uint, 0444);
+MODULE_PARM_DESC(debounce_us, "Stable time before an edge is accepted");
+
+static bool sw_debounce;
+module_param(sw_debounce, bool, 0444);
+MODULE_PARM_DESC(sw_debounce, "Debounce in software even if the controller can do it");
+
+#define STORM_WINDOW_NS	(10 * NSEC_PER_MSEC)
+#define STORM_WINDOWS_PER_SEC	(NSEC_PER_SEC / STORM_WINDOW_NS)
+
+static unsigned int storm_rate = 5000;
+module_param(storm_rate, uint, 0644);
+MODULE_PARM_DESC(storm_rate, "Edges/s on a line that mask its IRQ (0 - never)");
+
+static unsigned int storm_sample_ms = 10;
+module_param(storm_sample_ms, uint, 0644);
+MODULE_PARM_DESC(storm_sample_ms, "Sampling period while the IRQ is masked");
+
+static unsigned int storm_window_ms = 200;
+module_param(storm_window_ms, uint, 0644);
+MODULE_PARM_DESC(storm_window_ms, "Window over which the sampled rate is checked before unmasking");
 
 static bool simulate_busy=false;
 module_param(simulate_busy,bool,0660);
 
-static irqreturn_t hw_button_intr(int irq, void *dev_id) {
-	struct my_irq_data *data = (struct my_irq_data *)dev_id;
+static unsigned int busy_ms = 2000;
+module_param(busy_ms, uint, 0660);
+MODULE_PARM_DESC(busy_ms, "Length of the simulated load queued per press");
+
+static struct kmem_cache *line_cache;
+static struct input_line *lines[MAX_LINES];
+static int nr_lines;
+
+static struct workqueue_struct *busy_wq;
+
+struct dentry *root_dentry;
 
-	counter++;
+static void lat_record(struct lat_stats *st, u64 ns)
+{
+	unsigned int bucket = ns ? min(ilog2(ns) + 1, LAT_BUCKETS - 1) : 0;
+
+	if (!st->count || ns < st->min)
+		st->min = ns;
+	if (ns > st->max)
+		st->max = ns;
+	st->sum += ns;
+	st->count++;
+	st->buckets[bucket]++;
+}
 
-	data->led_state = !data->led_state;
-	gpio_set_value(led_gpio, data->led_state);
+static void busy_work_fn(struct work_struct *work)
+{
+	struct input_line *line = container_of(work, struct input_line,
+					       busy_work);
 
-	if (simulate_busy) {
-		msleep(2000);
-		pr_info("irq handled successfully\n");
+	msleep(busy_ms);
+	pr_info("%s: busy work done after %u ms\n", line->name, busy_ms);
+}
+
+/*
+ * Single producer: the top half, or the IRQ thread with software
+ * debounce, or storm_work while the IRQ is masked. tail is written by
+ * userspace.
+ */
+static void ring_push(struct input_line *line, u64 ts)
+{
+	struct edge_ring *ring = &line->ring;
+	struct button_event *ev;
+	u32 tail = smp_load_acquire(&ring->hdr->tail);
+
+	ring->seq++;
+	if (ring->head - tail >= ring->mask + 1) {
+		ring->dropped++;
+		return;
 	}
 
+	ev = &ring->entries[ring->head & ring->mask];
+	ev->ts_ns = ts;
+	ev->seq = ring->seq;
+	ev->counter = READ_ONCE(line->counter);
+
+	smp_store_release(&ring->hdr->head, ++ring->head);
+}
+
+/* Called from the IRQ thread after new records were pushed */
+static void ring_notify(struct edge_ring *ring)
+{
+	u32 pending = ring->head - smp_load_acquire(&ring->hdr->tail);
+
+	mutex_lock(&ring->efd_lock);
+	if (ring->efd && pending >= ring->threshold &&
+	    ring->last_pending < ring->threshold)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 8, 0)
+		eventfd_signal(ring->efd);
+#else
+		eventfd_signal(ring->efd, 1);
+#endif
+	ring->last_pending = pending;
+	mutex_unlock(&ring->efd_lock);
+}
+
+static int ring_init(struct edge_ring *ring)
+{
+	u32 capacity = roundup_pow_of_two(max(ring_size, 1U));
+	void *area;
+
+	area = vmalloc_user(PAGE_SIZE +
+			    PAGE_ALIGN((size_t)capacity *
+				       sizeof(struct button_event)));
+	if (!area)
+		return -ENOMEM;
+
+	ring->hdr = area;
+	ring->entries = area + PAGE_SIZE;
+	ring->mask = capacity - 1;
+	ring->hdr->capacity = capacity;
+	ring->hdr->entries_offset = PAGE_SIZE;
+	mutex_init(&ring->efd_lock);
+
+	return 0;
+}
+
+static void ring_deinit(struct edge_ring *ring)
+{
+	if (ring->efd)
+		eventfd_ctx_put(ring->efd);
+	vfree(ring->hdr);
+}
+
+/* Hands an accepted edge to the ring and the IRQ thread */
+static void edge_push(struct input_line *line, u64 ts)
+{
+	ring_push(line, ts);
+
+	if (!kfifo_put(&line->event_fifo, ts))
+		line->events_dropped++;
+}
+
+static enum hrtimer_restart debounce_timer_fn(struct hrtimer *timer)
+{
+	struct input_line *line = container_of(timer, struct input_line,
+					       db_timer);
+	u64 window = (u64)debounce_us * NSEC_PER_USEC;
+	u64 now = ktime_get_ns();
+
+	raw_spin_lock(&line->db_lock);
+	if (now - line->db_last < window) {
+		hrtimer_set_expires(timer, ns_to_ktime(line->db_last + window));
+		raw_spin_unlock(&line->db_lock);
+		return HRTIMER_RESTART;
+	}
+
+	line->db_settled_ts = line->db_first;
+	line->db_settled = true;
+	line->db_pending = false;
+	raw_spin_unlock(&line->db_lock);
+
+	irq_wake_thread(line->irq, line);
+
+	return HRTIMER_NORESTART;
+}
+
+/* IRQ thread: accept a settled burst only if the line is still low */
+static void debounce_commit(struct input_line *line)
+{
+	bool settled;
+	u64 first;
+
+	raw_spin_lock_irq(&line->db_lock);
+	settled = line->db_settled;
+	first = line->db_settled_ts;
+	line->db_settled = false;
+	raw_spin_unlock_irq(&line->db_lock);
+
+	if (!settled)
+		return;
+
+	if (gpio_get_value_cansleep(line->gpio)) {
+		line->db_released++;
+		return;
+	}
+
+	line->db_accepted++;
+	edge_push(line, first);
+}
+
+/*
+ * Returns true if this edge takes the line over its rate budget, in
+ * which case the IRQ has been masked and sampling takes over.
+ */
+static bool storm_check(struct input_line *line, u64 ts)
+{
+	u32 budget = storm_rate / STORM_WINDOWS_PER_SEC;
+	u32 rate;
+
+	if (ts - line->win_start >= STORM_WINDOW_NS) {
+		/* An idle gap in between means the rate dropped to zero */
+		WRITE_ONCE(line->cur_rate,
+			   ts - line->win_start < 2 * STORM_WINDOW_NS ?
+			   line->win_edges * STORM_WINDOWS_PER_SEC : 0);
+		line->win_start = ts;
+		line->win_edges = 0;
+	}
+
+	line->win_edges++;
+	rate = line->win_edges * STORM_WINDOWS_PER_SEC;
+	if (rate > line->peak_rate)
+		line->peak_rate = rate;
+
+	if (!storm_rate || line->win_edges <= max(budget, 1U))
+		return false;
+
+	disable_irq_nosync(line->irq);
+	WRITE_ONCE(line->storm, true);
+	WRITE_ONCE(line->cur_rate, rate);
+	line->storms++;
+	line->last_level = -1;
+	line->win_start = ts;
+	line->win_edges = 0;
+	queue_delayed_work(system_wq, &line->storm_work, 0);
+
+	return true;
+}
+
+/*
+ * Sampled edges/s below which the IRQ is unmasked again: half of
+ * storm_rate for hysteresis, and at most an eighth of the sampling rate.
+ * A storm aliased down by the sampler reads as random levels, i.e. a
+ * falling edge in about one sample out of four, so it never looks quiet
+ * enough.
+ */
+static u32 storm_exit_rate(void)
+{
+	u32 samples_per_sec = MSEC_PER_SEC / max(storm_sample_ms, 1U);
+
+	return max(min(storm_rate / 2, samples_per_sec / 8), 1U);
+}
+
+/*
+ * Sampling mode: report falling levels as edges and unmask the IRQ once
+ * the sampled edge rate over storm_window_ms drops below
+ * storm_exit_rate(). While the IRQ is masked this is the only producer
+ * for the ring and event fifo.
+ */
+static void storm_work_fn(struct work_struct *work)
+{
+	struct input_line *line = container_of(to_delayed_work(work),
+					       struct input_line, storm_work);
+	u64 window = (u64)max(storm_window_ms, storm_sample_ms) * NSEC_PER_MSEC;
+	u64 now = ktime_get_ns();
+	u32 rate;
+	int level;
+
+	/*
+	 * A debounce burst cut short by the storm is dropped. Once the
+	 * thread has finished any commit in flight, this is the only
+	 * producer.
+	 */
+	if (line->sw_debounce && line->last_level < 0) {
+		hrtimer_cancel(&line->db_timer);
+		raw_spin_lock_irq(&line->db_lock);
+		line->db_pending = false;
+		line->db_settled = false;
+		raw_spin_unlock_irq(&line->db_lock);
+		synchronize_irq(line->irq);
+	}
+
+	if (line->last_level < 0)
+		pr_info_ratelimited("%s: edge storm, IRQ masked\n", line->name);
+
+	level = gpio_get_value_cansleep(line->gpio);
+	if (line->last_level == 1 && !level) {
+		edge_push(line, now);
+		line->sampled_edges++;
+		line->win_edges++;
+		irq_wake_thread(line->irq, line);
+	}
+	line->last_level = level;
+
+	if (now - line->win_start < window)
+		goto resample;
+
+	rate = div64_u64((u64)line->win_edges * NSEC_PER_SEC,
+			 now - line->win_start);
+	WRITE_ONCE(line->cur_rate, rate);
+	line->win_start = now;
+	line->win_edges = 0;
+
+	if (rate >= storm_exit_rate())
+		goto resample;
+
+	line->storm_exits++;
+	WRITE_ONCE(line->storm, false);
+	pr_info_ratelimited("%s: rate down to %u edges/s, IRQ unmasked\n",
+			    line->name, rate);
+	enable_irq(line->irq);
+	return;
+
+resample:
+	queue_delayed_work(system_wq, &line->storm_work,
+			   msecs_to_jiffies(max(storm_sample_ms, 1U)));
+}
+
+/* Top half: timestamp and enqueue only */
+static irqreturn_t hw_button_intr(int irq, void *dev_id) {
+	struct input_line *line = dev_id;
+	u64 ts = ktime_get_ns();
+
+	if (storm_check(line, ts))
+		return IRQ_HANDLED;
+
+	if (line->sw_debounce) {
+		raw_spin_lock(&line->db_lock);
+		if (!line->db_pending) {
+			line->db_pending = true;
+			line->db_first = ts;
+			hrtimer_start(&line->db_timer,
+				      ns_to_ktime((u64)debounce_us *
+						  NSEC_PER_USEC),
+				      HRTIMER_MODE_REL);
+		} else {
+			line->db_rejected++;
+		}
+		line->db_last = ts;
+		raw_spin_unlock(&line->db_lock);
+
+		lat_record(&line->hardirq_lat, ktime_get_ns() - ts);
+		return IRQ_HANDLED;
+	}
+
+	edge_push(line, ts);
+
+	lat_record(&line->hardirq_lat, ktime_get_ns() - ts);
+
 	return IRQ_WAKE_THREAD;
 }
 
 static irqreturn_t thread_button_intr(int irq, void *dev_id) {
-	pr_info("thread_button_intr called\n");
-	pr_info("counter: %d\n", counter);
+	struct input_line *line = dev_id;
+	u64 ts;
+
+	if (line->sw_debounce)
+		debounce_commit(line);
+
+	while (kfifo_get(&line->event_fifo, &ts)) {
+		struct button_event ev;
+
+		lat_record(&line->thread_lat, ktime_get_ns() - ts);
+
+		line->counter++;
+
+		ev.ts_ns = ts;
+		ev.seq = line->stream_seq++;
+		ev.counter = line->counter;
+		if (!kfifo_put(&line->stream_fifo, ev))
+			line->stream_dropped++;
+
+		if (line->led_gpio >= 0) {
+			line->led_state = !line->led_state;
+			gpio_set_value_cansleep(line->led_gpio,
+						line->led_state);
+		}
+
+		if (simulate_busy)
+			queue_work(busy_wq, &line->busy_work);
+	}
+
+	wake_up_interruptible(&line->stream_wait);
+	ring_notify(&line->ring);
+
+	pr_debug("%s: counter: %d\n", line->name, line->counter);
 
 	return IRQ_HANDLED;
 }
@@ -91,63 +569,303 @@ static int led_gpio_init(int gpio)
 	if (ret)
 		return ret;
 
-	led_gpio = gpio;
+	gpio_set_value_cansleep(gpio, 1);
+	pr_info("LED at GPIO%d ON\n", gpio);
 	return 0;
 }
 
-static int button_gpio_init(int gpio)
+static void led_gpio_deinit(int gpio)
+{
+	gpio_set_value_cansleep(gpio, 0);
+	pr_info("LED at GPIO%d OFF\n", gpio);
+}
+
+static int button_gpio_init(struct input_line *line)
 {
 	int ret;
 
-	ret = gpio_request(gpio, "Onboard user button");
+	ret = gpio_request(line->gpio, line->name);
 	if (ret)
 		goto err_register;
 
-	ret = gpio_direction_input(gpio);
+	ret = gpio_direction_input(line->gpio);
 	if (ret)
 		goto err_input;
 
-	ret = gpio_set_debounce(gpio, 200);
-	if (ret) {
-		pr_err("unable to set debounce time\n");
-		goto err_input;
+	if (!sw_debounce)
+		ret = gpio_set_debounce(line->gpio, debounce_us);
+	if (sw_debounce || ret) {
+		pr_info("GPIO%d: software debounce, %u us\n", line->gpio,
+			debounce_us);
+		line->sw_debounce = true;
 	}
 
-	button_irq = gpio_to_irq(gpio);
-	if (button_irq < 0) {
+	line->irq = gpio_to_irq(line->gpio);
+	if (line->irq < 0) {
 		pr_err("Unable to convert gpio to irq\n");
+		ret = line->irq;
 		goto err_input;
 	}
 
-	my_irq_data.led_state = 0;
+	pr_info("Init GPIO%d OK\n", line->gpio);
+
+	return 0;
+
+err_input:
+	gpio_free(line->gpio);
+err_register:
+	return ret;
+}
+
+static void lat_show(struct seq_file *s, const char *name,
+		     struct lat_stats *st)
+{
+	int i;
+
+	seq_printf(s, "%s: count %llu min %llu max %llu mean %llu ns\n", name,
+		   st->count, st->min, st->max,
+		   st->count ? div64_u64(st->sum, st->count) : 0);
+	for (i = 0; i < LAT_BUCKETS; i++)
+		if (st->buckets[i])
+			seq_printf(s, "  < %10llu ns %10u\n",
+				   1ULL << i, st->buckets[i]);
+}
+
+static int latency_show(struct seq_file *s, void *unused)
+{
+	struct input_line *line = s->private;
+	u32 rate = READ_ONCE(line->cur_rate);
+
+	/* In irq mode an idle line has no edge to close its last window */
+	if (!READ_ONCE(line->storm) &&
+	    ktime_get_ns() - READ_ONCE(line->win_start) >= 2 * STORM_WINDOW_NS)
+		rate = 0;
+
+	lat_show(s, "hardirq", &line->hardirq_lat);
+	lat_show(s, "thread", &line->thread_lat);
+	seq_printf(s, "events dropped: %lu\n", line->events_dropped);
+	seq_printf(s, "stream dropped: %lu\n", line->stream_dropped);
+	seq_printf(s, "ring dropped: %lu\n", line->ring.dropped);
+	seq_printf(s, "storm: %s, entered %lu left %lu\n",
+		   READ_ONCE(line->storm) ? "sampling" : "irq",
+		   line->storms, line->storm_exits);
+	seq_printf(s, "storm: sampled edges %lu, rate %u peak %u edges/s, unmask below %u\n",
+		   line->sampled_edges, rate, line->peak_rate,
+		   storm_exit_rate());
+	if (line->sw_debounce)
+		seq_printf(s, "debounce: accepted %lu rejected %lu released %lu\n",
+			   line->db_accepted, line->db_rejected,
+			   line->db_released);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(latency);
+
+static struct input_line *file_line(struct file *file)
+{
+	struct miscdevice *dev = file->private_data;
+
+	return container_of(dev, struct input_line, dev);
+}
+
+/* Returns as many whole events as fit in @count */
+static ssize_t stream_read(struct file *file, char __user *buf,
+			   size_t count, loff_t *ppos)
+{
+	struct input_line *line = file_line(file);
+	unsigned int copied;
+	ssize_t ret;
+
+	if (count < sizeof(struct button_event))
+		return -EINVAL;
+
+	ret = mutex_lock_interruptible(&line->stream_read_lock);
+	if (ret)
+		return ret;
+
+	while (kfifo_is_empty(&line->stream_fifo)) {
+		mutex_unlock(&line->stream_read_lock);
+
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+
+		ret = wait_event_interruptible(line->stream_wait,
+				!kfifo_is_empty(&line->stream_fifo));
+		if (ret)
+			return ret;
+
+		ret = mutex_lock_interruptible(&line->stream_read_lock);
+		if (ret)
+			return ret;
+	}
+
+	ret = kfifo_to_user(&line->stream_fifo, buf, count, &copied);
+	mutex_unlock(&line->stream_read_lock);
+
+	return ret ? ret : copied;
+}
+
+static __poll_t stream_poll(struct file *file, poll_table *wait)
+{
+	struct input_line *line = file_line(file);
+
+	poll_wait(file, &line->stream_wait, wait);
+
+	return kfifo_is_empty(&line->stream_fifo) ? 0 : EPOLLIN | EPOLLRDNORM;
+}
+
+/* Header and records are mapped writable so the consumer can store tail */
+static int stream_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	return remap_vmalloc_range(vma, file_line(file)->ring.hdr,
+				   vma->vm_pgoff);
+}
 
-	ret = request_threaded_irq((unsigned int)button_irq, hw_button_intr,
+static long stream_ioctl(struct file *file, unsigned int cmd,
+			 unsigned long arg)
+{
+	struct edge_ring *ring = &file_line(file)->ring;
+	struct onboard_io_eventfd req;
+	struct eventfd_ctx *efd = NULL;
+	struct eventfd_ctx *old;
+
+	if (cmd != ONBOARD_IO_SET_EVENTFD)
+		return -ENOTTY;
+
+	if (copy_from_user(&req, (void __user *)arg, sizeof(req)))
+		return -EFAULT;
+
+	if (req.fd >= 0) {
+		efd = eventfd_ctx_fdget(req.fd);
+		if (IS_ERR(efd))
+			return PTR_ERR(efd);
+	}
+
+	mutex_lock(&ring->efd_lock);
+	old = ring->efd;
+	ring->efd = efd;
+	ring->threshold = max(req.threshold, 1U);
+	ring->last_pending = 0;
+	mutex_unlock(&ring->efd_lock);
+
+	if (old)
+		eventfd_ctx_put(old);
+
+	return 0;
+}
+
+static int onboard_io_open(struct inode *inode, struct file *file)
+{
+	/* misc_open() has set private_data to our miscdevice */
+	return stream_open(inode, file);
+}
+
+static const struct file_operations stream_fops = {
+	.owner	= THIS_MODULE,
+	.open	= onboard_io_open,
+	.read	= stream_read,
+	.poll	= stream_poll,
+	.mmap	= stream_mmap,
+	.unlocked_ioctl	= stream_ioctl,
+	.compat_ioctl	= compat_ptr_ioctl,
+};
+
+static void line_destroy(struct input_line *line)
+{
+	if (line->dev_registered)
+		misc_deregister(&line->dev);
+
+	if (line->irq_requested) {
+		/* Balances a pending unmask from storm_work */
+		disable_irq(line->irq);
+		cancel_delayed_work_sync(&line->storm_work);
+		free_irq(line->irq, line);
+	}
+	hrtimer_cancel(&line->db_timer);
+
+	cancel_work_sync(&line->busy_work);
+
+	gpio_free(line->gpio);
+	pr_info("Deinit GPIO%d\n", line->gpio);
+
+	ring_deinit(&line->ring);
+	kmem_cache_free(line_cache, line);
+}
+
+static struct input_line *line_create(int index, int gpio)
+{
+	struct input_line *line;
+	int ret;
+
+	line = kmem_cache_zalloc(line_cache, GFP_KERNEL);
+	if (!line)
+		return ERR_PTR(-ENOMEM);
+
+	line->index = index;
+	line->gpio = gpio;
+	line->led_gpio = -1;
+	snprintf(line->name, sizeof(line->name), KBUILD_MODNAME "%d", index);
+
+	INIT_KFIFO(line->event_fifo);
+	INIT_KFIFO(line->stream_fifo);
+	init_waitqueue_head(&line->stream_wait);
+	mutex_init(&line->stream_read_lock);
+	INIT_WORK(&line->busy_work, busy_work_fn);
+	INIT_DELAYED_WORK(&line->storm_work, storm_work_fn);
+	raw_spin_lock_init(&line->db_lock);
+	hrtimer_init(&line->db_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	line->db_timer.function = &debounce_timer_fn;
+
+	ret = ring_init(&line->ring);
+	if (ret)
+		goto err_ring;
+
+	ret = button_gpio_init(line);
+	if (ret) {
+		pr_err("Can't set GPIO%d for button\n", gpio);
+		goto err_button;
+	}
+
+	return line;
+
+err_button:
+	ring_deinit(&line->ring);
+err_ring:
+	kmem_cache_free(line_cache, line);
+	return ERR_PTR(ret);
+}
+
+/* IRQ and device go live last, once the line is fully set up */
+static int line_start(struct input_line *line)
+{
+	int ret;
+
+	ret = request_threaded_irq((unsigned int)line->irq, hw_button_intr,
 				   thread_button_intr,
 				   IRQF_TRIGGER_FALLING | IRQF_ONESHOT,
-				   "hm7_irq", &my_irq_data);
+				   line->name, line);
 	if (ret) {
 		pr_err("Unable to request threaded irq\n");
-		goto err_input;
+		return ret;
 	}
+	line->irq_requested = true;
 
-	button_gpio = gpio;
-
-	pr_info("Init GPIO%d OK\n", button_gpio);
+	line->dev.minor = MISC_DYNAMIC_MINOR;
+	line->dev.name = line->name;
+	line->dev.fops = &stream_fops;
+	ret = misc_register(&line->dev);
+	if (ret) {
+		pr_err("Can't register /dev/%s\n", line->name);
+		return ret;
+	}
+	line->dev_registered = true;
 
 	return 0;
-
-err_input:
-	gpio_free(gpio);
-err_register:
-	return ret;
 }
 
-static void button_gpio_deinit(void)
+static void lines_destroy(void)
 {
-	if (button_gpio >= 0) {
-		gpio_free(button_gpio);
-		pr_info("Deinit GPIO%d\n", button_gpio);
-	}
+	while (nr_lines)
+		line_destroy(lines[--nr_lines]);
 }
 
 static void debugfs_deinit(void)
@@ -157,77 +875,134 @@ static void debugfs_deinit(void)
 
 static void debugfs_init(void)
 {
+	struct dentry *dir;
+	int i;
+
 	root_dentry = debugfs_create_dir(KBUILD_MODNAME, NULL);
 	if (IS_ERR_OR_NULL(root_dentry)) {
 		pr_err("Unable to create debugfs dir\n");
 		root_dentry = NULL;
+		return;
 	}
 
-	counter_dentry = debugfs_create_u32("counter", 0444, root_dentry,
-					    &counter);
-	if (!counter_dentry) {
-		pr_err("Unable to create counter debugfs entry\n");
-		debugfs_deinit();
+	for (i = 0; i < nr_lines; i++) {
+		dir = debugfs_create_dir(lines[i]->name, root_dentry);
+		debugfs_create_u32("counter", 0444, dir, &lines[i]->counter);
+		debugfs_create_file("latency", 0444, dir, lines[i],
+				    &latency_fops);
 	}
 
 	pr_info("Debugs fs entries created successfully\n");
 }
 
+/*
+ * Without an outputs list, keep the board demo: line 0 drives the
+ * uSD or MMC LED depending on the button state at load.
+ */
+static int outputs_init(void)
+{
+	int ret;
+	int i;
+
+	if (!nr_outputs) {
+		outputs[0] = gpio_get_value_cansleep(lines[0]->gpio) ? LED_MMC : LED_SD;
+		nr_outputs = 1;
+		lines[0]->led_gpio = outputs[0];
+	} else {
+		for (i = 0; i < nr_lines; i++)
+			lines[i]->led_gpio = outputs[i % nr_outputs];
+	}
+
+	for (i = 0; i < nr_outputs; i++) {
+		ret = led_gpio_init(outputs[i]);
+		if (ret) {
+			pr_err("Can't set GPIO%d for output\n", outputs[i]);
+			while (i--)
+				led_gpio_deinit(outputs[i]);
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+static void outputs_deinit(void)
+{
+	int i;
+
+	for (i = 0; i < nr_outputs; i++)
+		led_gpio_deinit(outputs[i]);
+}
+
 /* Module entry/exit points */
 static int __init onboard_io_init(void)
 {
+	struct input_line *line;
 	int ret;
-	int gpio;
-	int button_state;
+	int i;
 
-	ret = button_gpio_init(BUTTON);
-	if (ret) {
-		pr_err("Can't set GPIO%d for button\n", BUTTON);
-		goto err_button;
-	}
+	if (nr_inputs < 1)
+		return -EINVAL;
 
-	button_state = gpio_get_value(button_gpio);
+	busy_wq = alloc_workqueue("onboard_io_busy", WQ_UNBOUND, 1);
+	if (!busy_wq)
+		return -ENOMEM;
 
-	gpio = button_state ? LED_MMC : LED_SD;
-	if (ret) {
-		pr_err("Can't set GPIO%d for output\n", gpio);
-		goto err_button;
+	line_cache = kmem_cache_create("onboard_io_line",
+				       sizeof(struct input_line), 0,
+				       SLAB_HWCACHE_ALIGN, NULL);
+	if (!line_cache) {
+		ret = -ENOMEM;
+		goto err_cache;
 	}
 
-	ret = led_gpio_init(gpio);
-	if (ret) {
-		pr_err("Can't set GPIO%d for output\n", gpio);
-		goto err_led;
+	for (i = 0; i < nr_inputs; i++) {
+		line = line_create(i, inputs[i]);
+		if (IS_ERR(line)) {
+			ret = PTR_ERR(line);
+			goto err_lines;
+		}
+		lines[nr_lines++] = line;
 	}
 
-	gpio_set_value(led_gpio, 1);
-	pr_info("LED at GPIO%d ON\n", led_gpio);
+	ret = outputs_init();
+	if (ret)
+		goto err_lines;
+
+	for (i = 0; i < nr_lines; i++) {
+		ret = line_start(lines[i]);
+		if (ret)
+			goto err_start;
+	}
 
 	debugfs_init();
 
 	return 0;
 
-err_led:
-	button_gpio_deinit();
-err_button:
+err_start:
+	lines_destroy();
+	outputs_deinit();
+	goto err_free_cache;
+err_lines:
+	lines_destroy();
+err_free_cache:
+	kmem_cache_destroy(line_cache);
+err_cache:
+	destroy_workqueue(busy_wq);
 	return ret;
 }
 
 static void __exit onboard_io_exit(void)
 {
-	if (led_gpio >= 0) {
-		gpio_set_value(led_gpio, 0);
-		pr_info("LED at GPIO%d OFF\n", led_gpio);
-	}
-
-	button_gpio_deinit();
+	debugfs_deinit();
 
-	if (button_irq >= 0)
-		free_irq(button_irq, &my_irq_data);
+	/* Stop the IRQs first, the threads drive the LEDs */
+	lines_destroy();
+	outputs_deinit();
 
-	debugfs_deinit();
+	kmem_cache_destroy(line_cache);
+	destroy_workqueue(busy_wq);
 }
 
 module_init(onboard_io_init);
 module_exit(onboard_io_exit);
-
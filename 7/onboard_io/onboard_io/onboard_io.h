@@ -0,0 +1,43 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+/*
+ * Userspace ABI of /dev/onboard_ioN: read() records, the mmap()'d edge
+ * ring and its eventfd ioctl.
+ */
+#ifndef _ONBOARD_IO_H
+#define _ONBOARD_IO_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/* Record returned by read() on /dev/onboard_ioN, one per falling edge */
+struct button_event {
+	__u64 ts_ns;
+	__u32 seq;
+	__u32 counter;
+};
+
+/*
+ * Zero-copy edge ring shared with userspace through mmap() of
+ * /dev/onboard_ioN: a header page followed by capacity button_event
+ * records. The driver is the only producer and publishes head with a
+ * release store; the consumer reads head with acquire, processes
+ * records tail..head and then stores tail with release. Both indices
+ * run freely, record i lives at i & (capacity - 1). head and tail are in
+ * separate cache lines.
+ */
+struct edge_ring_hdr {
+	__u32 capacity;
+	__u32 entries_offset;
+	__u32 head __attribute__((aligned(64)));
+	__u32 tail __attribute__((aligned(64)));
+};
+
+/* ONBOARD_IO_SET_EVENTFD argument; fd < 0 detaches */
+struct onboard_io_eventfd {
+	__s32 fd;
+	__u32 threshold;
+};
+
+#define ONBOARD_IO_SET_EVENTFD	_IOW('b', 1, struct onboard_io_eventfd)
+
+#endif /* _ONBOARD_IO_H */